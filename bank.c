@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+
+// Banks past the two fixed ones, and snapshots of banks.
+//
+// A cartridge asks for more banks with the `banks` global. They start out
+// with the ROM's palette and font and an empty display.
+//
+// A snapshot is taken without copying anything: each of its pages is either
+// its own copy, or NULL, meaning the page hasn't changed in the bank since.
+// Before a page of a bank is written, bank_will_write() gives the snapshots
+// still sharing it a copy of the old contents. That copy is shared between
+// them and reference counted. So a snapshot costs one page per page written
+// after it was taken, and restoring it only copies those pages back.
+
+#define PAGE_SIZE  256
+#define PAGE_COUNT ((MEMORY_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct Page {
+    size_t refs;
+    uint8_t data[PAGE_SIZE];
+};
+
+struct Snapshot {
+    _Bool used;
+    size_t bank;
+    struct Page *pages[PAGE_COUNT];
+};
+
+size_t bank_count = BK_COUNT;
+
+static struct Snapshot snapshots[MAX_SNAPSHOTS];
+
+// How many snapshots share each page with its bank, and how many snapshots
+// each bank has, so that writes to a bank without any are cheap.
+static uint8_t sharing[BANKS_MAX][PAGE_COUNT];
+static size_t bank_snapshots[BANKS_MAX];
+
+static size_t page_len(size_t p) {
+    return MIN((size_t)PAGE_SIZE, MEMORY_SIZE - (p * PAGE_SIZE));
+}
+
+void bank_will_write(size_t bk, size_t addr, size_t sz) {
+    if (bank_snapshots[bk] == 0 || sz == 0)
+        return;
+
+    size_t last = MIN((addr + sz - 1) / PAGE_SIZE, (size_t)PAGE_COUNT - 1);
+
+    for (size_t p = addr / PAGE_SIZE; p <= last; ++p) {
+        if (sharing[bk][p] == 0)
+            continue;
+
+        struct Page *page = ecalloc(1, sizeof(struct Page));
+        page->refs = sharing[bk][p];
+        memcpy(page->data, &memory[bk][p * PAGE_SIZE], page_len(p));
+
+        for (size_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+            struct Snapshot *s = &snapshots[i];
+            if (s->used && s->bank == bk && s->pages[p] == NULL)
+                s->pages[p] = page;
+        }
+        sharing[bk][p] = 0;
+    }
+}
+
+// Snapshot bank bk. Returns the snapshot's id, or -1 if there are too many.
+ssize_t snapshot_bank(size_t bk) {
+    for (size_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+        struct Snapshot *s = &snapshots[i];
+        if (s->used)
+            continue;
+
+        s->used = true;
+        s->bank = bk;
+        memset(s->pages, 0x0, sizeof(s->pages));
+
+        for (size_t p = 0; p < PAGE_COUNT; ++p)
+            ++sharing[bk][p];
+        ++bank_snapshots[bk];
+
+        return i;
+    }
+    return -1;
+}
+
+_Bool snapshot_valid(size_t id) {
+    return id < MAX_SNAPSHOTS && snapshots[id].used;
+}
+
+// Copy a snapshot into bank bk, which needn't be the one it was taken of.
+void restore_snapshot(size_t id, size_t bk) {
+    struct Snapshot *s = &snapshots[id];
+
+    for (size_t p = 0; p < PAGE_COUNT; ++p) {
+        const uint8_t *src;
+
+        if (s->pages[p] != NULL)
+            src = s->pages[p]->data;
+        else if (s->bank != bk)
+            src = &memory[s->bank][p * PAGE_SIZE];
+        else
+            continue; // Unchanged since.
+
+        size_t addr = p * PAGE_SIZE;
+        bank_will_write(bk, addr, page_len(p));
+        memcpy(&memory[bk][addr], src, page_len(p));
+        mark_dirty(bk, addr, page_len(p));
+    }
+}
+
+void free_snapshot(size_t id) {
+    struct Snapshot *s = &snapshots[id];
+
+    for (size_t p = 0; p < PAGE_COUNT; ++p) {
+        if (s->pages[p] == NULL)
+            --sharing[s->bank][p];
+        else if (--s->pages[p]->refs == 0)
+            free(s->pages[p]);
+    }
+    --bank_snapshots[s->bank];
+
+    memset(s, 0x0, sizeof(*s));
+}
+
+// Set the number of banks, between BK_COUNT and BANKS_MAX. Banks that go away
+// take their snapshots with them.
+void resize_banks(size_t count) {
+    count = MIN(MAX(count, (size_t)BK_COUNT), (size_t)BANKS_MAX);
+
+    for (size_t bk = count; bk < bank_count; ++bk) {
+        for (size_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+            if (snapshots[i].used && snapshots[i].bank == bk)
+                free_snapshot(i);
+        }
+        free(memory[bk]);
+        memory[bk] = NULL;
+    }
+
+    for (size_t bk = bank_count; bk < count; ++bk) {
+        memory[bk] = ecalloc(MEMORY_SIZE, sizeof(uint8_t));
+        memcpy(&memory[bk][PALETTE_START], &memory[BK_Rom][PALETTE_START],
+            DISPLAY_START - PALETTE_START);
+        mark_dirty(bk, PALETTE_START, DISPLAY_START - PALETTE_START);
+    }
+
+    bank_count = count;
+    config.banks = count;
+
+    if (bank >= bank_count) {
+        bank = BK_Normal;
+        mark_all_dirty();
+    }
+}
+
+void deinit_banks(void) {
+    for (size_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+        if (snapshots[i].used)
+            free_snapshot(i);
+    }
+    resize_banks(BK_COUNT);
+}
@@ -0,0 +1,126 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cel7ce.h"
+
+// Kernels that expand glyph pixels into foreground/background values: RGBA
+// pixels from the packed font (see font_bits in render.c) for the tile cache,
+// or palette indices from the byte-per-pixel font for captures. The vector
+// versions are compiled for their instruction sets with target attributes and
+// picked at runtime by blend_init(), so the binary still runs on CPUs without
+// them.
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static void expand_row32(uint32_t *dst, uint8_t bits, uint32_t fg, uint32_t bg) {
+    for (size_t x = 0; x < FONT_WIDTH; ++x)
+        dst[x] = (bits >> x) & 1 ? fg : bg;
+}
+
+static void expand_glyph32_scalar(uint32_t *dst, const uint8_t *rows, uint32_t fg, uint32_t bg) {
+    for (size_t y = 0; y < FONT_HEIGHT; ++y)
+        expand_row32(&dst[y * FONT_WIDTH], rows[y], fg, bg);
+}
+
+static void expand8_scalar(uint8_t *dst, const uint8_t *mask, size_t n, uint8_t fg, uint8_t bg) {
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = mask[i] ? fg : bg;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Rows are expanded eight pixels at a time; the eighth spills into the start
+// of the next row, which overwrites it. The last row has nowhere to spill to,
+// so it's done separately.
+
+__attribute__((target("sse2")))
+static void expand_glyph32_sse2(uint32_t *dst, const uint8_t *rows, uint32_t fg, uint32_t bg) {
+    const __m128i lo  = _mm_set_epi32(8, 4, 2, 1);
+    const __m128i hi  = _mm_set_epi32(128, 64, 32, 16);
+    const __m128i fgv = _mm_set1_epi32(fg);
+    const __m128i bgv = _mm_set1_epi32(bg);
+
+    for (size_t y = 0; y < FONT_HEIGHT - 1; ++y, dst += FONT_WIDTH) {
+        __m128i b = _mm_set1_epi32(rows[y]);
+        __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(b, lo), lo);
+        __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(b, hi), hi);
+        _mm_storeu_si128((__m128i *)&dst[0],
+            _mm_or_si128(_mm_and_si128(m0, fgv), _mm_andnot_si128(m0, bgv)));
+        _mm_storeu_si128((__m128i *)&dst[4],
+            _mm_or_si128(_mm_and_si128(m1, fgv), _mm_andnot_si128(m1, bgv)));
+    }
+
+    expand_row32(dst, rows[FONT_HEIGHT - 1], fg, bg);
+}
+
+__attribute__((target("avx2")))
+static void expand_glyph32_avx2(uint32_t *dst, const uint8_t *rows, uint32_t fg, uint32_t bg) {
+    const __m256i bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    const __m256i fgv  = _mm256_set1_epi32(fg);
+    const __m256i bgv  = _mm256_set1_epi32(bg);
+
+    for (size_t y = 0; y < FONT_HEIGHT - 1; ++y, dst += FONT_WIDTH) {
+        __m256i b = _mm256_set1_epi32(rows[y]);
+        __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(b, bits), bits);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_blendv_epi8(bgv, fgv, m));
+    }
+
+    expand_row32(dst, rows[FONT_HEIGHT - 1], fg, bg);
+}
+
+__attribute__((target("sse2")))
+static void expand8_sse2(uint8_t *dst, const uint8_t *mask, size_t n, uint8_t fg, uint8_t bg) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fgv  = _mm_set1_epi8(fg);
+    const __m128i bgv  = _mm_set1_epi8(bg);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i m = _mm_loadu_si128((const __m128i *)&mask[i]);
+        m = _mm_cmpeq_epi8(m, zero);
+        __m128i px = _mm_or_si128(_mm_and_si128(m, bgv), _mm_andnot_si128(m, fgv));
+        _mm_storeu_si128((__m128i *)&dst[i], px);
+    }
+
+    expand8_scalar(&dst[i], &mask[i], n - i, fg, bg);
+}
+
+__attribute__((target("avx2")))
+static void expand8_avx2(uint8_t *dst, const uint8_t *mask, size_t n, uint8_t fg, uint8_t bg) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fgv  = _mm256_set1_epi8(fg);
+    const __m256i bgv  = _mm256_set1_epi8(bg);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i m = _mm256_loadu_si256((const __m256i *)&mask[i]);
+        m = _mm256_cmpeq_epi8(m, zero);
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm256_blendv_epi8(fgv, bgv, m));
+    }
+
+    expand8_sse2(&dst[i], &mask[i], n - i, fg, bg);
+}
+
+#endif
+
+void (*expand_glyph32)(uint32_t *dst, const uint8_t *rows, uint32_t fg, uint32_t bg) =
+    expand_glyph32_scalar;
+void (*expand8)(uint8_t *dst, const uint8_t *mask, size_t n, uint8_t fg, uint8_t bg) =
+    expand8_scalar;
+
+// Pick the best kernels for this CPU. Until this is called, the scalar ones
+// are used.
+void blend_init(void) {
+#ifdef HAVE_X86_KERNELS
+    if (SDL_HasAVX2()) {
+        expand_glyph32 = expand_glyph32_avx2;
+        expand8 = expand8_avx2;
+    } else if (SDL_HasSSE2()) {
+        expand_glyph32 = expand_glyph32_sse2;
+        expand8 = expand8_sse2;
+    }
+#endif
+}
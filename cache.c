@@ -0,0 +1,707 @@
+#if !defined(_WIN32) && !defined(__WIN32__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+#include "vec.h"
+
+// Loaded cartridges are cached on disk, keyed by a hash of their source, so
+// that launching the same cartridge again can skip parsing it.
+//
+// fe cartridges are cached as the forms they were read into, in a simple
+// binary encoding, which are then evaluated one by one as usual. Janet
+// cartridges are cached as their top-level forms, compiled and marshalled
+// along with the bindings each one defines, the way tools/mkimage does for
+// the builtin scripts. Either way, the top level still runs on every load, so
+// whatever it prints, reads or draws happens on a hit too.
+//
+// Janet inlines the value of a def into every form that refers to it, which
+// would leave a cached form holding whatever the def came to the first time.
+// So the top-level defs a Janet cartridge makes are turned into vars as it
+// loads, with or without the cache, and each cached form reads them through
+// their ref.
+//
+// Each file starts with a header holding the version of cel7 and Janet that
+// wrote it, the cache's own revision, the key and the source's length, and
+// the payload's length and hash. A file that doesn't match is ignored, and
+// replaced once the cartridge has been loaded from source. Setting
+// CEL7_NO_CACHE turns caching off.
+//
+// The key is a hash of all of those and the source. For Janet, it also
+// covers the config that set_vals() hands the cartridge, since the globals it
+// defines are inlined into the compiled forms.
+
+#define CACHE_MAGIC   "cel7che"
+#define CACHE_VERSION VERSION "/" JANET_VERSION
+
+// Bump this whenever a cached payload would no longer load the same way: the
+// builtin Janet bindings, or what set_vals() defines, changed in a way that a
+// cartridge's compiled forms could refer to, or either encoding changed. The
+// release version alone doesn't change often enough for that.
+#define CACHE_REVISION 2
+
+struct CacheHeader {
+    char magic[8];
+    char version[32];
+    uint64_t revision;
+    uint64_t key;
+    uint64_t source_len;
+    uint64_t payload_len;
+    uint64_t payload_sum;
+};
+
+static struct {
+    _Bool enabled;
+    _Bool hit;
+    enum LangMode lang;
+    char path[4096];
+    struct CacheHeader header;
+
+    // On a hit: the payload.
+    uint8_t *data;
+    size_t len, pos;
+
+    // On a miss: fe forms as they're read, or Janet's compiled forms, each
+    // as a tuple of the thunk followed by the symbols and entries it defined.
+    vec_char_t forms;
+    _Bool forms_ok;
+    JanetArray *thunks;
+    JanetTable *rreg;
+
+    // Janet's environment as of the last form run, to see what the next one
+    // defines.
+    JanetTable *before;
+} cache;
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+// $XDG_CACHE_HOME/cel7, or ~/.cache/cel7. Returns false if there's nowhere
+// to put it.
+static _Bool cache_dir(char *dst, size_t sz) {
+#if defined(_WIN32) || defined(__WIN32__)
+    UNUSED(dst);
+    UNUSED(sz);
+    return false;
+#else
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (xdg != NULL && *xdg != '\0') {
+        snprintf(dst, sz, "%s", xdg);
+    } else if (home != NULL && *home != '\0') {
+        snprintf(dst, sz, "%s/.cache", home);
+    } else {
+        return false;
+    }
+
+    if (mkdir(dst, 0755) == -1 && errno != EEXIST)
+        return false;
+    strncat(dst, "/cel7", sz - strlen(dst) - 1);
+    if (mkdir(dst, 0755) == -1 && errno != EEXIST)
+        return false;
+
+    return true;
+#endif
+}
+
+// Read the cache file into cache.data, if it's there and matches.
+static _Bool read_cache(void) {
+    FILE *fp = fopen(cache.path, "rb");
+    if (fp == NULL)
+        return false;
+
+    struct CacheHeader header;
+    _Bool ok = fread(&header, sizeof(header), 1, fp) == 1
+        && !memcmp(&header, &cache.header, offsetof(struct CacheHeader, payload_len));
+
+    if (ok) {
+        cache.len = header.payload_len;
+        cache.data = ecalloc(cache.len + 1, sizeof(uint8_t));
+        ok = fread(cache.data, sizeof(uint8_t), cache.len, fp) == cache.len
+            && fnv1a(FNV_OFFSET, cache.data, cache.len) == header.payload_sum;
+    }
+    fclose(fp);
+
+    if (!ok) {
+        free(cache.data);
+        cache.data = NULL;
+    }
+    return ok;
+}
+
+// Write the file out whole under a temporary name first, so that a reader
+// never sees half of it. The name is unique to this writer, since another
+// instance may be saving the same cartridge at the same time.
+static void write_cache(const void *payload, size_t len) {
+#if defined(_WIN32) || defined(__WIN32__)
+    // cache_dir() never finds anywhere to put it.
+    UNUSED(payload);
+    UNUSED(len);
+#else
+    char tmp[sizeof(cache.path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache.path);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return;
+
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        remove(tmp);
+        return;
+    }
+
+    struct CacheHeader header = cache.header;
+    header.payload_len = len;
+    header.payload_sum = fnv1a(FNV_OFFSET, payload, len);
+
+    _Bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(payload, sizeof(uint8_t), len, fp) == len;
+    ok = fclose(fp) == 0 && ok;
+
+    if (ok && rename(tmp, cache.path) == 0) {
+        if (config.debug)
+            log_message("cache: saved %s\n", cache.path);
+    } else {
+        remove(tmp);
+    }
+#endif
+}
+
+// Make a reverse registry for janet_marshal() from env: its values, by name.
+// Only values compared by identity are included; a string or number that
+// happened to equal some global would otherwise be replaced by whatever that
+// global holds when it's unmarshalled.
+JanetTable *reverse_registry(JanetTable *env) {
+    JanetTable *lookup = janet_env_lookup(env);
+    JanetTable *rreg = janet_table(lookup->count);
+
+    for (int32_t i = 0; i < lookup->capacity; ++i) {
+        JanetKV *kv = &lookup->data[i];
+        if (!janet_checktype(kv->key, JANET_SYMBOL))
+            continue;
+
+        switch (janet_type(kv->value)) {
+        case JANET_FUNCTION: case JANET_CFUNCTION: case JANET_ABSTRACT:
+        case JANET_TABLE: case JANET_ARRAY: case JANET_FIBER: case JANET_BUFFER:
+            janet_table_put(rreg, kv->value, kv->key);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return rreg;
+}
+
+// The config a Janet cartridge's top level can see, field by field so that
+// neither padding nor whatever follows the title's NUL gets in.
+static uint64_t hash_config(uint64_t h) {
+    h = fnv1a(h, config.title, strlen(config.title));
+    h = fnv1a(h, &config.width, sizeof(config.width));
+    h = fnv1a(h, &config.height, sizeof(config.height));
+    h = fnv1a(h, &config.scale, sizeof(config.scale));
+    h = fnv1a(h, &config.fps, sizeof(config.fps));
+    h = fnv1a(h, &config.replay, sizeof(config.replay));
+    h = fnv1a(h, &config.heap, sizeof(config.heap));
+    h = fnv1a(h, &config.banks, sizeof(config.banks));
+    h = fnv1a(h, &config.debug, sizeof(config.debug));
+    return h;
+}
+
+// Look for a file for the given source, setting cache.enabled, and
+// cache.hit if it's there.
+static void open_cache(enum LangMode lm, const char *src, size_t len, const char *dir) {
+    uint64_t revision = CACHE_REVISION;
+    uint64_t key = fnv1a(FNV_OFFSET, CACHE_VERSION, strlen(CACHE_VERSION));
+    key = fnv1a(key, &revision, sizeof(revision));
+    key = fnv1a(key, &lm, sizeof(lm));
+    key = fnv1a(key, src, len);
+
+    // fe forms are only what was read, so they don't depend on the config.
+    // Keying them on it would also miss every time fe had to be restarted
+    // with a bigger heap.
+    if (lm == LM_Janet)
+        key = hash_config(key);
+
+    memcpy(cache.header.magic, CACHE_MAGIC, sizeof(cache.header.magic));
+    strncpy(cache.header.version, CACHE_VERSION, sizeof(cache.header.version) - 1);
+    cache.header.revision = revision;
+    cache.header.key = key;
+    cache.header.source_len = len;
+
+    snprintf(cache.path, sizeof(cache.path), "%s/%016llx.%s", dir,
+        (unsigned long long)key, lm == LM_Janet ? "jimage" : "feforms");
+
+    cache.enabled = true;
+    cache.hit = read_cache();
+
+    if (cache.hit && config.debug)
+        log_message("cache: loading %s\n", cache.path);
+}
+
+// Get ready to load from source, recording what's loaded if the cache is on.
+static void start_miss(void) {
+    if (cache.lang == LM_Fe) {
+        vec_init(&cache.forms);
+        cache.forms_ok = true;
+        return;
+    }
+
+    cache.before = janet_table_clone(janet_env);
+    janet_gcroot(janet_wrap_table(cache.before));
+
+    if (cache.enabled) {
+        cache.thunks = janet_array(0);
+        cache.rreg = reverse_registry(janet_env);
+        janet_gcroot(janet_wrap_array(cache.thunks));
+        janet_gcroot(janet_wrap_table(cache.rreg));
+    }
+}
+
+// Start loading a cartridge with the given source. Until cache_end(), the
+// cache either serves what's stored for it or records what it loads to.
+void cache_begin(enum LangMode lm, const char *src, size_t len) {
+    memset(&cache, 0x0, sizeof(cache));
+    cache.lang = lm;
+
+    char dir[4096];
+    if (getenv("CEL7_NO_CACHE") == NULL && cache_dir(dir, sizeof(dir)))
+        open_cache(lm, src, len, dir);
+
+    if (!cache.hit)
+        start_miss();
+}
+
+// Marshal the Janet forms that were run into a cache file. The refs of the
+// cartridge's globals are emptied meanwhile: the forms fill them in again
+// when they're run, and what they hold now may not even marshal.
+static void save_janet(void) {
+    JanetArray *values = janet_array(0);
+    janet_gcroot(janet_wrap_array(values));
+
+    for (int32_t i = 0; i < cache.thunks->count; ++i) {
+        const Janet *form = janet_unwrap_tuple(cache.thunks->data[i]);
+        for (int32_t j = 2; j < janet_tuple_length(form); j += 2) {
+            Janet ref = janet_table_get(janet_unwrap_table(form[j]), janet_ckeywordv("ref"));
+            if (!janet_checktype(ref, JANET_ARRAY) || janet_unwrap_array(ref)->count == 0)
+                continue;
+            janet_array_push(values, ref);
+            janet_array_push(values, janet_unwrap_array(ref)->data[0]);
+            janet_unwrap_array(ref)->data[0] = janet_wrap_nil();
+        }
+    }
+
+    JanetBuffer *buf = janet_buffer(4096);
+    JanetTryState tstate;
+    if (!janet_try(&tstate)) {
+        janet_marshal(buf, janet_wrap_array(cache.thunks), cache.rreg, 0);
+        write_cache(buf->data, buf->count);
+    } else if (config.debug) {
+        log_message("cache: can't marshal %s: %s\n", cache.path,
+            (const char *)janet_to_string(tstate.payload));
+    }
+    janet_restore(&tstate);
+
+    for (int32_t i = 0; i < values->count; i += 2)
+        janet_unwrap_array(values->data[i])->data[0] = values->data[i + 1];
+    janet_gcunroot(janet_wrap_array(values));
+}
+
+// Finish loading. ok is whether the cartridge loaded without errors; only
+// then is what was loaded saved.
+void cache_end(_Bool ok) {
+    if (cache.enabled && !cache.hit && ok) {
+        if (cache.lang == LM_Fe && cache.forms_ok)
+            write_cache(cache.forms.data, cache.forms.length);
+        else if (cache.lang == LM_Janet)
+            save_janet();
+    }
+
+    free(cache.data);
+    if (cache.lang == LM_Fe && !cache.hit)
+        vec_deinit(&cache.forms);
+    if (cache.before != NULL)
+        janet_gcunroot(janet_wrap_table(cache.before));
+    if (cache.thunks != NULL) {
+        janet_gcunroot(janet_wrap_array(cache.thunks));
+        janet_gcunroot(janet_wrap_table(cache.rreg));
+    }
+
+    memset(&cache, 0x0, sizeof(cache));
+}
+
+// Run a compiled top-level form, as janet_dobytes() would. Returns false if
+// it failed.
+static _Bool run_thunk(JanetFunction *thunk) {
+    JanetFiber *fiber = janet_fiber(thunk, 64, 0, NULL);
+    fiber->env = janet_env;
+
+    Janet ret;
+    JanetSignal status = janet_continue(fiber, janet_wrap_nil(), &ret);
+    if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_EVENT) {
+        janet_stacktrace(fiber, ret);
+        return false;
+    }
+    return true;
+}
+
+// Turn the entry a top-level def made into a var's: its value goes into a
+// ref, which forms compiled from here on read instead of inlining it. Macros
+// are only used while compiling, and are left alone.
+static void def_to_var(JanetTable *entry) {
+    if (!janet_checktype(janet_table_get(entry, janet_ckeywordv("ref")), JANET_NIL)
+            || !janet_checktype(janet_table_get(entry, janet_ckeywordv("macro")), JANET_NIL))
+        return;
+
+    JanetArray *ref = janet_array(1);
+    janet_array_push(ref, janet_table_remove(entry, janet_ckeywordv("value")));
+    janet_table_put(entry, janet_ckeywordv("ref"), janet_wrap_array(ref));
+}
+
+// After a form has run from source: turn the defs it made into vars, and
+// record it with the bindings it added or replaced, if it's to be cached.
+static void record_form(JanetFunction *thunk) {
+    JanetTable *before = cache.before;
+    _Bool same = before->capacity == janet_env->capacity;
+
+    JanetArray *form = NULL;
+    if (cache.thunks != NULL) {
+        form = janet_array(1);
+        janet_array_push(form, janet_wrap_function(thunk));
+    }
+
+    // Entries stay in their slot until the table grows, so while it hasn't,
+    // comparing slot by slot is enough.
+    for (int32_t i = 0; i < janet_env->capacity; ++i) {
+        JanetKV *kv = &janet_env->data[i];
+        if (!janet_checktype(kv->key, JANET_SYMBOL) || !janet_checktype(kv->value, JANET_TABLE))
+            continue;
+
+        if (same ? janet_equals(kv->key, before->data[i].key) && janet_equals(kv->value, before->data[i].value)
+                 : janet_equals(kv->value, janet_table_rawget(before, kv->key)))
+            continue;
+
+        def_to_var(janet_unwrap_table(kv->value));
+        if (form != NULL) {
+            janet_array_push(form, kv->key);
+            janet_array_push(form, kv->value);
+        }
+    }
+
+    if (form != NULL)
+        janet_array_push(cache.thunks, janet_wrap_tuple(janet_tuple_n(form->data, form->count)));
+
+    if (same) {
+        memcpy(before->data, janet_env->data, janet_env->capacity * sizeof(JanetKV));
+        before->count = janet_env->count;
+        before->deleted = janet_env->deleted;
+    } else {
+        janet_gcunroot(janet_wrap_table(before));
+        cache.before = janet_table_clone(janet_env);
+        janet_gcroot(janet_wrap_table(cache.before));
+    }
+}
+
+// Compile and run one top-level form from source. Returns false, having
+// reported why, if it failed.
+static _Bool run_form(Janet form, const uint8_t *where, const char *path) {
+    JanetCompileResult res = janet_compile(form, janet_env, where);
+    if (res.status != JANET_COMPILE_OK) {
+        if (res.macrofiber != NULL) {
+            janet_eprintf("compile error in %s: ", path);
+            janet_stacktrace(res.macrofiber, janet_wrap_string(res.error));
+        } else {
+            janet_eprintf("compile error in %s: %s\n", path, (const char *)res.error);
+        }
+        return false;
+    }
+
+    JanetFunction *thunk = janet_thunk(res.funcdef);
+    if (!run_thunk(thunk))
+        return false;
+
+    record_form(thunk);
+    return true;
+}
+
+// Parse, compile and run src form by form, the way janet_dobytes() does.
+static _Bool run_source(const char *src, size_t len, const char *path) {
+    const uint8_t *where = janet_cstring(path);
+    janet_gcroot(janet_wrap_string(where));
+
+    JanetParser parser;
+    janet_parser_init(&parser);
+
+    size_t i = 0;
+    _Bool ok = true, done = false;
+    while (!done) {
+        while (ok && janet_parser_has_more(&parser))
+            ok = run_form(janet_parser_produce(&parser), where, path);
+        if (!ok)
+            break;
+
+        switch (janet_parser_status(&parser)) {
+        case JANET_PARSE_DEAD:
+            done = true;
+            break;
+        case JANET_PARSE_ERROR:
+            janet_eprintf("parse error in %s: %s\n", path, janet_parser_error(&parser));
+            ok = false;
+            break;
+        default:
+            if (i >= len)
+                janet_parser_eof(&parser);
+            else
+                janet_parser_consume(&parser, src[i++]);
+            break;
+        }
+    }
+
+    janet_parser_deinit(&parser);
+    janet_gcunroot(janet_wrap_string(where));
+    return ok;
+}
+
+// Unmarshal the cached forms, or return nil if they can't be used.
+static Janet unmarshal_forms(void) {
+    JanetTryState tstate;
+    Janet forms = janet_wrap_nil();
+    if (!janet_try(&tstate)) {
+        JanetTable *reg = janet_env_lookup(janet_env);
+        forms = janet_unmarshal(cache.data, cache.len, 0, reg, NULL);
+        if (!janet_checktype(forms, JANET_ARRAY))
+            janet_panic("expected an array");
+    } else {
+        log_message("cache: can't load %s: %s\n", cache.path,
+            (const char *)janet_to_string(tstate.payload));
+        forms = janet_wrap_nil();
+    }
+    janet_restore(&tstate);
+    return forms;
+}
+
+// Run the cached forms in order, binding what each one defined before it
+// runs, as compiling it would have, and moving the value of each def it made
+// into its ref afterwards.
+static _Bool run_cached(JanetArray *forms) {
+    for (int32_t i = 0; i < forms->count; ++i) {
+        const Janet *form = janet_unwrap_tuple(forms->data[i]);
+        int32_t n = janet_tuple_length(form);
+
+        for (int32_t j = 1; j < n; j += 2)
+            janet_table_put(janet_env, form[j], form[j + 1]);
+
+        if (!run_thunk(janet_unwrap_function(form[0])))
+            return false;
+
+        for (int32_t j = 2; j < n; j += 2) {
+            JanetTable *entry = janet_unwrap_table(form[j]);
+            Janet ref = janet_table_get(entry, janet_ckeywordv("ref"));
+            if (!janet_checktype(ref, JANET_ARRAY)
+                    || !janet_checktype(janet_table_get(entry, janet_ckeywordv("macro")), JANET_NIL))
+                continue;
+
+            // A var's form sets its ref itself, and leaves no value.
+            Janet value = janet_table_remove(entry, janet_ckeywordv("value"));
+            JanetArray *array = janet_unwrap_array(ref);
+            if (janet_checktype(value, JANET_NIL))
+                continue;
+            if (array->count == 0)
+                janet_array_push(array, value);
+            else
+                array->data[0] = value;
+        }
+    }
+    return true;
+}
+
+// Janet: run the cartridge's top level, from the cache on a hit and from src
+// otherwise. Errors are reported as janet_dobytes() would. Returns false if
+// the cartridge failed to load.
+_Bool cache_run_janet(const char *src, size_t len, const char *path) {
+    if (cache.hit) {
+        Janet forms = unmarshal_forms();
+        if (!janet_checktype(forms, JANET_NIL)) {
+            janet_gcroot(forms);
+            _Bool ok = run_cached(janet_unwrap_array(forms));
+            janet_gcunroot(forms);
+            return ok;
+        }
+
+        // Treat it as a miss, and overwrite it.
+        free(cache.data);
+        cache.data = NULL;
+        cache.hit = false;
+        start_miss();
+    }
+
+    return run_source(src, len, path);
+}
+
+// fe forms are encoded as a tag byte and a payload:
+//   'N'                     nil
+//   'n' <fe_Number>         number, as its bytes
+//   's' <len> <bytes>       string
+//   'y' <len> <bytes>       symbol
+//   'l' <count> <tail> <elements, last first>
+// with lengths and counts as varints. Lists are stored back to front so that
+// they can be rebuilt with fe_cons() alone.
+
+static void put_byte(uint8_t b) {
+    vec_push(&cache.forms, b);
+}
+
+static void put_varint(size_t v) {
+    for (; v >= 0x80; v >>= 7)
+        put_byte((v & 0x7F) | 0x80);
+    put_byte(v);
+}
+
+static uint8_t get_byte(void) {
+    return cache.pos < cache.len ? cache.data[cache.pos++] : 0;
+}
+
+static size_t get_varint(void) {
+    size_t v = 0;
+    for (size_t shift = 0; shift < sizeof(size_t) * 8; shift += 7) {
+        uint8_t byte = get_byte();
+        v |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return v;
+}
+
+// Scratch space for string and symbol contents.
+static char *text_buf = NULL;
+static size_t text_cap = 0;
+
+static void reserve_text(size_t len) {
+    if (len + 1 <= text_cap)
+        return;
+    text_cap = MAX(len + 1, text_cap * 2);
+    text_buf = realloc(text_buf, text_cap);
+    if (text_buf == NULL)
+        errx(1, "Couldn't allocate %zu bytes\n", text_cap);
+}
+
+static void encode_text(fe_Context *ctx, fe_Object *obj, uint8_t tag) {
+    reserve_text(256);
+    size_t n;
+    // fe_tostring() truncates silently; grow until it doesn't.
+    while ((n = fe_tostring(ctx, obj, text_buf, (int)text_cap)) >= text_cap - 1)
+        reserve_text(text_cap * 2);
+
+    put_byte(tag);
+    put_varint(n);
+    vec_pusharr(&cache.forms, text_buf, n);
+}
+
+static void encode_fe(fe_Context *ctx, fe_Object *obj) {
+    switch (fe_type(ctx, obj)) {
+    case FE_TNIL:
+        put_byte('N');
+        break;
+    case FE_TNUMBER: {
+        fe_Number n = fe_tonumber(ctx, obj);
+        put_byte('n');
+        vec_pusharr(&cache.forms, (char *)&n, sizeof(n));
+        break;
+    }
+    case FE_TSTRING:
+        encode_text(ctx, obj, 's');
+        break;
+    case FE_TSYMBOL:
+        encode_text(ctx, obj, 'y');
+        break;
+    case FE_TPAIR: {
+        vec_void_t elems;
+        vec_init(&elems);
+        for (; fe_type(ctx, obj) == FE_TPAIR; obj = fe_cdr(ctx, obj))
+            vec_push(&elems, fe_car(ctx, obj));
+
+        put_byte('l');
+        put_varint(elems.length);
+        encode_fe(ctx, obj);
+        for (int i = elems.length - 1; i >= 0; --i)
+            encode_fe(ctx, elems.data[i]);
+
+        vec_deinit(&elems);
+        break;
+    }
+    default:
+        // The reader doesn't make anything else.
+        cache.forms_ok = false;
+        break;
+    }
+}
+
+static fe_Object *decode_fe(fe_Context *ctx) {
+    switch (get_byte()) {
+    case 'n': {
+        fe_Number n = 0;
+        for (size_t i = 0; i < sizeof(n); ++i)
+            ((uint8_t *)&n)[i] = get_byte();
+        return fe_number(ctx, n);
+    }
+    case 's':
+    case 'y': {
+        uint8_t tag = cache.data[cache.pos - 1];
+        size_t len = get_varint();
+        len = MIN(len, cache.len - cache.pos);
+        reserve_text(len);
+        memcpy(text_buf, &cache.data[cache.pos], len);
+        text_buf[len] = '\0';
+        cache.pos += len;
+        return tag == 's' ? fe_string(ctx, text_buf) : fe_symbol(ctx, text_buf);
+    }
+    case 'l': {
+        size_t count = get_varint();
+        fe_Object *res = decode_fe(ctx);
+
+        // As fe's reader does, keep only the list built so far on the GC
+        // stack, however long it gets.
+        int gc = fe_savegc(ctx);
+        fe_pushgc(ctx, res);
+        for (size_t i = 0; i < count; ++i) {
+            fe_Object *car = decode_fe(ctx);
+            res = fe_cons(ctx, car, res);
+            fe_restoregc(ctx, gc);
+            fe_pushgc(ctx, res);
+        }
+        return res;
+    }
+    default:
+        return fe_bool(ctx, 0);
+    }
+}
+
+// fe: the next top-level form, or NULL at the end. On a hit it comes from the
+// cache; otherwise it's read from fp, and recorded.
+fe_Object *cache_read_fe(fe_Context *ctx, FILE *fp) {
+    if (cache.hit)
+        return cache.pos < cache.len ? decode_fe(ctx) : NULL;
+
+    fe_Object *obj = fe_readfp(ctx, fp);
+    if (obj != NULL && cache.enabled && cache.forms_ok)
+        encode_fe(ctx, obj);
+    return obj;
+}
@@ -18,7 +18,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <SDL.h>
-#include <sys/time.h>
 
 #include "fe.h"
 #include "janet.h"
@@ -32,19 +31,44 @@ typedef SSIZE_T ssize_t;
 #define PALETTE_START       0x4000
 #define FONT_START          0x4040
 #define DISPLAY_START       0x52a0    /* bank 1 */
-#define FE_CTX_DATA_SIZE    65535
+#define DISPLAY_CELLS       ((MEMORY_SIZE - DISPLAY_START) / 2)
+#define FE_CTX_DATA_SIZE    65535     /* default fe heap */
+#define FE_HEAP_MAX         (64 * 1024 * 1024)
+#define BANKS_MAX           16        /* including the fixed ones */
+#define MAX_SNAPSHOTS       64
+#define DEFAULT_FPS         30
 #define FONT_HEIGHT         7
 #define FONT_WIDTH          7
 #define FONT_FALLBACK_GLYPH 0x7F
 
+// A captured display state: width and height in cells (16 bits each), the
+// time in milliseconds (32 bits), then everything from PALETTE_START to the
+// end of the bank.
+#define CAPTURE_HEADER      8
+#define CAPTURE_SIZE        (CAPTURE_HEADER + MEMORY_SIZE - PALETTE_START)
+#define CAPTURE_ADDR(addr)  (CAPTURE_HEADER + (addr) - PALETTE_START)
+
 struct Config {
 	char title[512];
 	size_t width;
 	size_t height;
 	size_t scale;
+	double fps;
+	double replay;
+	size_t heap;        // fe heap size, in bytes
+	size_t banks;       // Number of memory banks
 	bool debug;
 };
 
+// fe's heap and what it's been up to. Collections are counted by a pointer
+// object that every mark phase visits; fe has no other hook to count them by.
+struct FeHeap {
+	size_t size;        // Current heap size, in bytes
+	size_t collections; // Since fe was last started
+	size_t restarts;    // Times fe was restarted with a bigger heap
+	_Bool exhausted;    // Set when fe raises "out of memory"
+};
+
 struct Mode {
 	enum ModeType {
 		MT_Start  = 0,
@@ -67,9 +91,21 @@ enum ScriptCallback {
 	SC_step    = 1,
 	SC_keydown = 2,
 	SC_mouse   = 3,
+	SC_events  = 4,
 	SC_COUNT,
 };
 
+// A queued input event (see input.c).
+struct InputEvent {
+	enum InputKind {
+		IK_Key,    // keydown(name)
+		IK_Text,   // keydown(name), from text input
+		IK_Mouse,  // mouse(name, n, x, y)
+	} kind;
+	char name[32];
+	double n, x, y;
+};
+
 enum Bank {
 	BK_Normal = 0,
 	BK_Rom    = 1,
@@ -80,8 +116,52 @@ enum LangMode {
 	LM_Fe, LM_Janet
 };
 
+struct Ring {
+	uint8_t *buf;          // Delta records, oldest first, wrapping around
+	size_t size;
+	size_t head;           // Offset of the oldest record
+	size_t used;
+
+	size_t state_size;
+	size_t frames;         // States stored, including base
+	size_t max_frames;     // Zero for no limit besides size
+	uint8_t *base;         // The oldest state
+	uint8_t *last;         // The newest state
+	uint8_t *scratch;
+};
+
+struct RingIter {
+	const struct Ring *ring;
+	size_t off;
+	size_t left;
+	uint8_t *state;
+	_Bool started;
+};
+
+struct RingCursor {
+	const struct Ring *ring;
+	size_t off;            // Offset of the record after the current state
+	size_t index;          // Of the current state, from the oldest
+	uint8_t *state;
+};
+
+struct Scheduler {
+	uint64_t freq;         // Counter ticks per second
+	uint64_t period;       // Counter ticks per step
+	uint64_t next;         // When the next step is due
+	uint64_t delay_until;  // Set by delay(); no steps are run until then
+
+	_Bool virtual_clock;   // Time only moves on sched_advance() (headless)
+	uint64_t virtual_now;
+
+	size_t steps;          // Steps run so far
+	size_t late;           // Steps run behind schedule to catch up
+	size_t dropped;        // Steps skipped because we were too far behind
+};
+
 extern struct Config config;
 extern struct Mode mode;
+extern struct FeHeap fe_heap;
 
 // Should we switch to MT_Error mode after setup?
 // Set to true if there was an error in eval.
@@ -89,12 +169,27 @@ extern _Bool load_error;
 
 extern enum LangMode lang;
 
-extern struct timeval delay_set;
-extern struct timeval delay_val;
+extern struct Scheduler sched;
 
-extern uint8_t *memory[BK_COUNT];
+// Options for running without a window (-H).
+struct Headless {
+	size_t ticks;       // Number of ticks to run for
+	char *input;        // Scripted input file
+	char *output;       // Where to write the final frame
+	char *bench;        // Where to append timing statistics
+	char *cartridge;    // Cartridge name, for the statistics
+	_Bool cells_only;   // Skip rasterization, output the cell buffer
+};
+
+extern struct Headless headless;
+extern size_t (*alloc_counter)(void);
+extern double startup_ms;
+
+extern uint8_t *memory[BANKS_MAX];
+extern size_t bank_count;
 extern size_t bank;
 extern uint8_t color;
+extern uint64_t rng_state;
 
 extern JanetTable *janet_env;
 extern void *fe_ctx_data;
@@ -107,24 +202,135 @@ extern SDL_Window *window;
 extern SDL_Renderer *renderer;
 extern SDL_Texture *texture;
 
+extern uint32_t *framebuffer;
+
 extern const char font[96 * FONT_HEIGHT][FONT_WIDTH];
-extern const struct JanetReg janet_apis[16];
-extern const struct ApiFunc fe_apis[19];
+extern const unsigned char builtin_image[];
+extern const size_t builtin_image_len;
+extern const struct JanetReg janet_apis[26];
+extern const JanetAbstractType janet_view_type;
+extern const struct ApiFunc fe_apis[33];
 
 #define UNUSED(x) (void)(x)
 #define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define fe_errorf(...) (raise_errorf(LM_Fe, __VA_ARGS__))
 #define unreachable()  (__unreachable(__FILE__, __func__, __LINE__))
 
+void rng_seed(uint64_t seed);
+uint32_t rng_next(void);
+void init_mem(void);
+void init_vm(void);
+void set_vals(void);
+_Bool restart_fe(size_t size);
+void deinit_mem(void);
+void deinit_vm(void);
+
 void *ecalloc(size_t nmemb, size_t size);
+void log_message(const char *format, ...);
 _Noreturn void __unreachable(const char *file, const char *func, int line);
 uint32_t decode_u32_from_bytes(uint8_t *bytes);
 char *get_username(void);
 void load(char *user_filename);
+void reset_call_cache(void);
+void reset_fe_call_cache(void);
+_Bool func_exists(const char *fnname);
 void call_func(const char *fnname, const char *arg_fmt, ...);
 void get_string_global(char *name, char *buf, size_t sz);
 float get_number_global(char *name);
 void __attribute__((format(printf, 2, 3))) raise_errorf(enum LangMode lang, const char *fmt, ...);
 void check_user_address(enum LangMode lm, size_t addr, size_t sz, _Bool write);
+void check_bank_address(enum LangMode lm, size_t bk, size_t addr, size_t sz, _Bool write);
+
+void step(void);
+_Bool restart_cartridge(void);
+void send_keydown(const char *name);
+void send_mouse(const char *button, double n, double x, double y);
+_Bool send_events(const struct InputEvent *events, size_t count);
+
+void input_key(const char *name);
+void input_text(const char *text);
+void input_button(const char *button, double n, double x, double y);
+void input_motion(double x, double y);
+void input_wheel(double dy);
+void input_flush(void);
+
+int run_headless(void);
+
+void cache_begin(enum LangMode lm, const char *src, size_t len);
+void cache_end(_Bool ok);
+_Bool cache_run_janet(const char *src, size_t len, const char *path);
+fe_Object *cache_read_fe(fe_Context *ctx, FILE *fp);
+JanetTable *reverse_registry(JanetTable *env);
+
+uint64_t sched_now(void);
+void sched_init(double fps);
+void sched_resume(void);
+void sched_advance(void);
+void sched_delay(double seconds);
+_Bool sched_holding(void);
+uint32_t sched_timeout(void);
+size_t sched_due(void);
+
+extern void (*expand_glyph32)(uint32_t *dst, const uint8_t *rows, uint32_t fg, uint32_t bg);
+extern void (*expand8)(uint8_t *dst, const uint8_t *mask, size_t n, uint8_t fg, uint8_t bg);
+void blend_init(void);
+
+void fill_cells(long x, long y, long w, long h, uint8_t glyph, uint8_t attr);
+void put_row(long x, long y, const uint8_t *chars, size_t n, const uint8_t *attrs, size_t nattrs);
+void put_cells(long x, long y, const uint8_t *chars, size_t n, const uint8_t *attrs, size_t nattrs);
+int get_cell(long x, long y);
+void blit_cells(long dx, long dy, long w, long h, size_t sbk, long sx, long sy);
+void scroll_cells(long dx, long dy, uint8_t glyph, uint8_t attr);
+
+void resize_banks(size_t count);
+void deinit_banks(void);
+void bank_will_write(size_t bk, size_t addr, size_t sz);
+ssize_t snapshot_bank(size_t bk);
+_Bool snapshot_valid(size_t id);
+void restore_snapshot(size_t id, size_t bk);
+void free_snapshot(size_t id);
+
+void mark_dirty(size_t bk, size_t addr, size_t sz);
+void mark_all_dirty(void);
+void render_resize(void);
+void render_deinit(void);
+_Bool render(SDL_Rect *rect);
+void capture_state(uint8_t *state);
+void capture_size(const uint8_t *state, size_t *width, size_t *height);
+uint32_t capture_time(const uint8_t *state);
+void rasterize_capture(const uint8_t *state, uint8_t *indices);
+
+void ring_init(struct Ring *r, size_t size, size_t state_size, size_t max_frames);
+void ring_deinit(struct Ring *r);
+void ring_clear(struct Ring *r);
+void ring_copy(struct Ring *dst, const struct Ring *src);
+void ring_push(struct Ring *r, const uint8_t *state);
+void ring_iter_start(const struct Ring *r, struct RingIter *it, uint8_t *state);
+_Bool ring_iter_next(struct RingIter *it);
+void ring_cursor_last(const struct Ring *r, struct RingCursor *c, uint8_t *state);
+_Bool ring_cursor_prev(struct RingCursor *c);
+_Bool ring_cursor_next(struct RingCursor *c);
+void ring_truncate(struct Ring *r, const struct RingCursor *c);
+
+_Bool record_active(void);
+void record_start(void);
+void record_frame(const uint8_t *state);
+void record_stop(void);
+void record_step(void);
+_Bool replay_active(void);
+void replay_init(double seconds, double fps);
+void replay_save(void);
+void replay_deinit(void);
+
+_Bool rewind_active(void);
+_Bool rewind_paused(void);
+void rewind_init(void);
+void rewind_deinit(void);
+void rewind_step(void);
+void rewind_back(void);
+void rewind_forward(void);
+void rewind_resume(void);
 
 #endif
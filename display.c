@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "cel7ce.h"
+
+// Operations on rectangles of display cells, shared by the fe and Janet APIs.
+// They write to the current bank's display, so that a frame can be drawn in
+// another bank while it's not displayed. Everything is clipped to the display
+// rather than raising an error, and done a row at a time: one memmove or
+// memcpy, and one mark_dirty(), per row.
+
+struct Rect {
+    long x, y, w, h;
+};
+
+static size_t cell_addr(long x, long y) {
+    return DISPLAY_START + ((y * config.width + x) * 2);
+}
+
+// The number of whole rows that fit in display memory. Zero if the display
+// has no cells at all, which every caller has to allow for.
+static long display_rows(void) {
+    if (config.width == 0 || config.height == 0)
+        return 0;
+    return MIN((long)config.height, (long)(DISPLAY_CELLS / config.width));
+}
+
+// Clip r to the display. Returns false if nothing is left.
+static _Bool clip(struct Rect *r) {
+    long x1 = MIN(r->x + r->w, (long)config.width);
+    long y1 = MIN(r->y + r->h, display_rows());
+    r->x = MAX(r->x, 0L);
+    r->y = MAX(r->y, 0L);
+    r->w = x1 - r->x;
+    r->h = y1 - r->y;
+    return r->w > 0 && r->h > 0;
+}
+
+// Fill a rectangle with one glyph and attribute.
+void fill_cells(long x, long y, long w, long h, uint8_t glyph, uint8_t attr) {
+    static uint8_t row[DISPLAY_CELLS * 2];
+
+    struct Rect r = { x, y, w, h };
+    if (!clip(&r))
+        return;
+
+    for (long i = 0; i < r.w; ++i) {
+        row[i * 2 + 0] = glyph;
+        row[i * 2 + 1] = attr;
+    }
+
+    size_t sz = r.w * 2;
+    for (long dy = r.y; dy < r.y + r.h; ++dy) {
+        size_t addr = cell_addr(r.x, dy);
+        bank_will_write(bank, addr, sz);
+        memcpy(&memory[bank][addr], row, sz);
+        mark_dirty(bank, addr, sz);
+    }
+}
+
+// Write n characters on row y, starting at x, each with its own attribute
+// from attrs, or with color once attrs runs out. Every byte is a glyph,
+// newlines included.
+void put_row(long x, long y, const uint8_t *chars, size_t n, const uint8_t *attrs, size_t nattrs) {
+    struct Rect r = { x, y, (long)MIN(n, (size_t)DISPLAY_CELLS), 1 };
+    if (!clip(&r))
+        return;
+
+    size_t skip = r.x - x;
+    size_t addr = cell_addr(r.x, r.y);
+    size_t sz = r.w * 2;
+
+    bank_will_write(bank, addr, sz);
+    for (long i = 0; i < r.w; ++i) {
+        size_t c = skip + i;
+        memory[bank][addr + i * 2 + 0] = chars[c];
+        memory[bank][addr + i * 2 + 1] = c < nattrs ? attrs[c] : color;
+    }
+    mark_dirty(bank, addr, sz);
+}
+
+// put_row(), except that a newline moves down a row, back to x. attrs is
+// indexed alongside chars, so the newline's attribute is skipped.
+void put_cells(long x, long y, const uint8_t *chars, size_t n, const uint8_t *attrs, size_t nattrs) {
+    size_t start = 0;
+
+    for (size_t i = 0; i <= n; ++i) {
+        if (i < n && chars[i] != '\n')
+            continue;
+
+        put_row(x, y++, &chars[start], i - start,
+            start < nattrs ? &attrs[start] : NULL, start < nattrs ? nattrs - start : 0);
+        start = i + 1;
+    }
+}
+
+// The glyph at (x, y) in the current bank's display, or -1 if that's off the
+// display.
+int get_cell(long x, long y) {
+    if (x < 0 || y < 0 || x >= (long)config.width || y >= display_rows())
+        return -1;
+    return memory[bank][cell_addr(x, y)];
+}
+
+// Copy the w*h cells at (sx, sy) in bank sbk's display to (dx, dy) in the
+// current bank's. The parts of either rectangle that are off the display are
+// left out.
+void blit_cells(long dx, long dy, long w, long h, size_t sbk, long sx, long sy) {
+    long ox = dx - sx, oy = dy - sy;
+
+    // Clip the source, move it to the destination and clip that, then move
+    // it back for the source.
+    struct Rect src = { sx, sy, w, h };
+    if (!clip(&src))
+        return;
+
+    struct Rect dst = { src.x + ox, src.y + oy, src.w, src.h };
+    if (!clip(&dst))
+        return;
+
+    src = (struct Rect){ dst.x - ox, dst.y - oy, dst.w, dst.h };
+
+    // When the two overlap, go bottom-up if the rows move down, so that no
+    // row is overwritten before it's copied.
+    _Bool down = sbk == bank && dst.y > src.y;
+    size_t sz = dst.w * 2;
+
+    for (long i = 0; i < dst.h; ++i) {
+        long row = down ? dst.h - 1 - i : i;
+        size_t to = cell_addr(dst.x, dst.y + row);
+        bank_will_write(bank, to, sz);
+        memmove(&memory[bank][to], &memory[sbk][cell_addr(src.x, src.y + row)], sz);
+        mark_dirty(bank, to, sz);
+    }
+}
+
+// Shift the whole display by (dx, dy) cells, filling the cells that are left
+// behind with glyph and attr.
+void scroll_cells(long dx, long dy, uint8_t glyph, uint8_t attr) {
+    long w = config.width, h = display_rows();
+    if (h == 0)
+        return;
+
+    blit_cells(dx, dy, w, h, bank, 0, 0);
+
+    // The columns and rows that nothing was copied into.
+    if (dx > 0)
+        fill_cells(0, 0, dx, h, glyph, attr);
+    else if (dx < 0)
+        fill_cells(w + dx, 0, -dx, h, glyph, attr);
+
+    if (dy > 0)
+        fill_cells(0, 0, w, dy, glyph, attr);
+    else if (dy < 0)
+        fill_cells(0, h + dy, w, -dy, glyph, attr);
+}
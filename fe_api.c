@@ -47,7 +47,34 @@ fe_rand(fe_Context *ctx, fe_Object *arg)
 		fe_errorf("Expected non-zero argument.");
 	}
 
-	return fe_number(ctx, (float)(rand() % n));
+	return fe_number(ctx, (float)(rng_next() % n));
+}
+
+// Convert a poke payload to bytes in buf: a string, a number (one byte), or a
+// list of numbers (one byte each). Returns the number of bytes.
+static size_t
+payload_bytes(fe_Context *ctx, fe_Object *payload, char *buf, size_t size)
+{
+	size_t sz = 0;
+
+	switch (fe_type(ctx, payload)) {
+	case FE_TSTRING:
+		sz = fe_tostring(ctx, payload, buf, size);
+		break;
+	case FE_TPAIR:
+		for (; !fe_isnil(ctx, payload); payload = fe_cdr(ctx, payload)) {
+			if (sz == size)
+				fe_errorf("List too long.");
+			buf[sz++] = (uint8_t)fe_tonumber(ctx, fe_car(ctx, payload));
+		}
+		break;
+	default:
+		buf[0] = (uint8_t)fe_tonumber(ctx, payload);
+		sz = 1;
+		break;
+	}
+
+	return sz;
 }
 
 static fe_Object *
@@ -57,39 +84,34 @@ fe_poke(fe_Context *ctx, fe_Object *arg)
 	fe_Object *payload = fe_nextarg(ctx, &arg);
 
 	static char buf[MEMORY_SIZE];
-	size_t sz = 0;
-
-	if (fe_type(ctx, payload) == FE_TSTRING) {
-		sz = fe_tostring(ctx, payload, buf, sizeof(buf));
-	} else {
-		buf[0] = (uint8_t)fe_tonumber(ctx, payload);
-		sz = 1;
-	}
+	size_t sz = payload_bytes(ctx, payload, buf, sizeof(buf));
 
 	check_user_address(LM_Fe, addr, sz, true);
 
+	bank_will_write(bank, addr, sz);
 	memcpy(&memory[bank][addr], buf, sz);
+	mark_dirty(bank, addr, sz);
 
 	return fe_bool(ctx, 0);
 }
 
+// (peek addr) is one byte; (peek addr n) is a string of n bytes, which fe cuts
+// short at the first zero. Use peekl for binary data.
 static fe_Object *
 fe_peek(fe_Context *ctx, fe_Object *arg)
 {
 	size_t addr = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	size_t size = 1;
 
 	if (fe_type(ctx, arg) == FE_TPAIR) {
-		size = (size_t)fe_tonumber(ctx, fe_car(ctx, arg));
+		static char buf[MEMORY_SIZE];
+		size_t size = (size_t)fe_tonumber(ctx, fe_car(ctx, arg));
 
 		check_user_address(LM_Fe, addr, size, false);
 
-		char *buf = calloc(size, sizeof(char));
 		memcpy(buf, (void *)&memory[bank][addr], size);
+		buf[size] = '\0';
 
-		fe_Object *retval = fe_string(ctx, (const char *)&buf);
-		free(buf);
-		return retval;
+		return fe_string(ctx, buf);
 	} else {
 		check_user_address(LM_Fe, addr, 1, false);
 
@@ -97,6 +119,123 @@ fe_peek(fe_Context *ctx, fe_Object *arg)
 	}
 }
 
+// (peekl addr n): n bytes as a list of numbers.
+static fe_Object *
+fe_peekl(fe_Context *ctx, fe_Object *arg)
+{
+	size_t addr = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t size = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	check_user_address(LM_Fe, addr, size, false);
+
+	// Build it from the end, keeping only the list so far on the GC stack.
+	fe_Object *res = fe_bool(ctx, 0);
+	int gc = fe_savegc(ctx);
+	for (size_t i = size; i > 0; --i) {
+		res = fe_cons(ctx, fe_number(ctx, (float)memory[bank][addr + i - 1]), res);
+		fe_restoregc(ctx, gc);
+		fe_pushgc(ctx, res);
+	}
+
+	return res;
+}
+
+// Little-endian 16 and 32-bit values, as the palette is stored. fe numbers are
+// floats, so 32-bit values above 2^24 lose their low bits; colours fit.
+
+static fe_Object *
+peek_n(fe_Context *ctx, fe_Object *arg, size_t width)
+{
+	size_t addr = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	check_user_address(LM_Fe, addr, width, false);
+
+	uint32_t value = 0;
+	for (size_t b = width; b > 0; --b)
+		value = (value << 8) | memory[bank][addr + b - 1];
+
+	return fe_number(ctx, (float)value);
+}
+
+static fe_Object *
+poke_n(fe_Context *ctx, fe_Object *arg, size_t width)
+{
+	size_t addr = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	uint32_t value = (uint32_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	check_user_address(LM_Fe, addr, width, true);
+
+	bank_will_write(bank, addr, width);
+	for (size_t b = 0; b < width; ++b)
+		memory[bank][addr + b] = (value >> (b * 8)) & 0xFF;
+	mark_dirty(bank, addr, width);
+
+	return fe_bool(ctx, 0);
+}
+
+static fe_Object *
+fe_peek16(fe_Context *ctx, fe_Object *arg)
+{
+	return peek_n(ctx, arg, 2);
+}
+
+static fe_Object *
+fe_peek32(fe_Context *ctx, fe_Object *arg)
+{
+	return peek_n(ctx, arg, 4);
+}
+
+static fe_Object *
+fe_poke16(fe_Context *ctx, fe_Object *arg)
+{
+	return poke_n(ctx, arg, 2);
+}
+
+static fe_Object *
+fe_poke32(fe_Context *ctx, fe_Object *arg)
+{
+	return poke_n(ctx, arg, 4);
+}
+
+// (memcpy dst-bank dst src-bank src n). Overlapping ranges are fine, so this
+// is memmove as well.
+static fe_Object *
+fe_memcpy(fe_Context *ctx, fe_Object *arg)
+{
+	size_t dbk = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t dst = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t sbk = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t src = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t sz  = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	check_bank_address(LM_Fe, sbk, src, sz, false);
+	check_bank_address(LM_Fe, dbk, dst, sz, true);
+
+	bank_will_write(dbk, dst, sz);
+	memmove(&memory[dbk][dst], &memory[sbk][src], sz);
+	mark_dirty(dbk, dst, sz);
+
+	return fe_bool(ctx, 0);
+}
+
+// (memset bank addr byte n)
+static fe_Object *
+fe_memset(fe_Context *ctx, fe_Object *arg)
+{
+	size_t bk   = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t addr = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	uint8_t byte = (uint8_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t sz   = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	check_bank_address(LM_Fe, bk, addr, sz, true);
+
+	bank_will_write(bk, addr, sz);
+	memset(&memory[bk][addr], byte, sz);
+	mark_dirty(bk, addr, sz);
+
+	return fe_bool(ctx, 0);
+}
+
 static fe_Object *
 fe_color(fe_Context *ctx, fe_Object *arg)
 {
@@ -104,6 +243,8 @@ fe_color(fe_Context *ctx, fe_Object *arg)
 	return fe_bool(ctx, 0);
 }
 
+// (put x y str...): write each string's bytes, newlines included, one after
+// the other along row y.
 static fe_Object *
 fe_put(fe_Context *ctx, fe_Object *arg)
 {
@@ -113,35 +254,52 @@ fe_put(fe_Context *ctx, fe_Object *arg)
 		fe_errorf("Cannot write to bank.");
 	}
 
-	size_t sx = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	size_t sy = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-
-	fe_Object *str = NULL;
-	size_t x = sx;
+	long x = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long y = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
 
 	do {
-		str = fe_nextarg(ctx, &arg);
-		size_t sz = fe_tostring(ctx, str, (char *)&buf, sizeof(buf));
-
-		for (size_t i = 0; i < sz && x < config.width; ++i, ++x) {
-			size_t coord = sy * config.width + x;
-			size_t addr = DISPLAY_START + (coord * 2);
-			memory[BK_Normal][addr + 0] = buf[i];
-			memory[BK_Normal][addr + 1] = color;
-		}
-
+		size_t sz = fe_tostring(ctx, fe_nextarg(ctx, &arg), (char *)&buf, sizeof(buf));
+		put_row(x, y, (uint8_t *)buf, sz, NULL, 0);
+		x += sz;
 	} while (fe_type(ctx, arg) == FE_TPAIR);
 
 	return fe_bool(ctx, 0);
 }
 
+// (putc x y str attrs): put, with an attribute per character, from a string
+// or a list of numbers. Newlines in str start a new row.
+static fe_Object *
+fe_putc(fe_Context *ctx, fe_Object *arg)
+{
+	static char chars[MEMORY_SIZE];
+	static char attrs[MEMORY_SIZE];
+
+	if (bank == BK_Rom) {
+		fe_errorf("Cannot write to bank.");
+	}
+
+	long x = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long y = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t n = fe_tostring(ctx, fe_nextarg(ctx, &arg), chars, sizeof(chars));
+	size_t nattrs = payload_bytes(ctx, fe_nextarg(ctx, &arg), attrs, sizeof(attrs));
+
+	put_cells(x, y, (uint8_t *)chars, n, (uint8_t *)attrs, nattrs);
+
+	return fe_bool(ctx, 0);
+}
+
 static fe_Object *
 fe_get(fe_Context *ctx, fe_Object *arg)
 {
-	size_t x = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	size_t y = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	uint8_t res = memory[BK_Normal][y * config.width + x + 0];
-	return fe_number(ctx, res);
+	long x = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long y = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	int glyph = get_cell(x, y);
+	if (glyph < 0) {
+		fe_errorf("Cell (%ld, %ld) is off the display.", x, y);
+	}
+
+	return fe_number(ctx, glyph);
 }
 
 static fe_Object *
@@ -151,27 +309,71 @@ fe_fill(fe_Context *ctx, fe_Object *arg)
 		fe_errorf("Cannot write to bank.");
 	}
 
-	size_t x = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	size_t y = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	size_t w = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
-	size_t h = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long x = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long y = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long w = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long h = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
 
 	char buf[2] = {0};
 	size_t sz = fe_tostring(ctx, fe_nextarg(ctx, &arg), (char *)&buf, sizeof(buf));
 	if (sz < 1 || sz > 1) {
 		fe_error(ctx, "Expected a string with one character");
 	}
-	size_t c = buf[0];
-
-	for (size_t dy = y; dy < (y + h); ++dy) {
-		for (size_t dx = x; dx < (x + w); ++dx) {
-			size_t coord = dy * config.width + dx;
-			size_t addr = DISPLAY_START + (coord * 2);
-			memory[BK_Normal][addr + 0] = c;
-			memory[BK_Normal][addr + 1] = color;
+
+	fill_cells(x, y, w, h, buf[0], color);
+
+	return fe_bool(ctx, 0);
+}
+
+// (blit x y w h sx sy [bank]): copy the w*h cells at (sx, sy) to (x, y). The
+// source is the display of the given bank, or of the current one.
+static fe_Object *
+fe_blit(fe_Context *ctx, fe_Object *arg)
+{
+	if (bank == BK_Rom) {
+		fe_errorf("Cannot write to bank.");
+	}
+
+	long x = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long y = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long w = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long h = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long sx = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long sy = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t sbk = bank;
+
+	if (fe_type(ctx, arg) == FE_TPAIR) {
+		sbk = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+		check_bank_address(LM_Fe, sbk, DISPLAY_START, DISPLAY_CELLS * 2, false);
+	}
+
+	blit_cells(x, y, w, h, sbk, sx, sy);
+
+	return fe_bool(ctx, 0);
+}
+
+// (scroll dx dy [char]): shift the display, filling in behind it with char
+// (or spaces) in the current color.
+static fe_Object *
+fe_scroll(fe_Context *ctx, fe_Object *arg)
+{
+	if (bank == BK_Rom) {
+		fe_errorf("Cannot write to bank.");
+	}
+
+	long dx = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	long dy = (long)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	char buf[2] = " ";
+	if (fe_type(ctx, arg) == FE_TPAIR) {
+		size_t sz = fe_tostring(ctx, fe_nextarg(ctx, &arg), (char *)&buf, sizeof(buf));
+		if (sz != 1) {
+			fe_error(ctx, "Expected a string with one character");
 		}
 	}
 
+	scroll_cells(dx, dy, buf[0], color);
+
 	return fe_bool(ctx, 0);
 }
 
@@ -235,9 +437,7 @@ fe_delay(fe_Context *ctx, fe_Object *arg)
 		fe_errorf("Delay %f invalid.", delay);
 	}
 
-	delay_val.tv_sec  = (time_t)roundf(delay);
-	delay_val.tv_usec = (suseconds_t)((delay - roundf(delay)) * 1000000);
-	gettimeofday(&delay_set, NULL);
+	sched_delay(delay);
 
 	return fe_bool(ctx, 0);
 }
@@ -254,26 +454,86 @@ fe_swibnk(fe_Context *ctx, fe_Object *arg)
 {
 	float bank_arg = fe_tonumber(ctx, fe_nextarg(ctx, &arg));
 
-	if (bank_arg < 0 || bank_arg > BK_COUNT) {
+	if (bank_arg < 0 || bank_arg >= bank_count) {
 		fe_errorf("Cannot switch to bank %.f.", bank_arg);
 	}
 
+	if (bank != (size_t)bank_arg)
+		mark_all_dirty();
 	bank = (size_t)bank_arg;
 
 	return fe_bool(ctx, 0);
 }
 
-const struct ApiFunc fe_apis[19] = {
+// (snapbnk bank): snapshot a bank, returning the snapshot's id. Nothing is
+// copied until the bank is written to.
+static fe_Object *
+fe_snapbnk(fe_Context *ctx, fe_Object *arg)
+{
+	size_t bk = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	check_bank_address(LM_Fe, bk, 0, 1, false);
+
+	ssize_t id = snapshot_bank(bk);
+	if (id < 0) {
+		fe_errorf("Too many snapshots.");
+	}
+
+	return fe_number(ctx, (float)id);
+}
+
+// (rstbnk id bank): copy a snapshot back into a bank.
+static fe_Object *
+fe_rstbnk(fe_Context *ctx, fe_Object *arg)
+{
+	size_t id = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+	size_t bk = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	if (!snapshot_valid(id)) {
+		fe_errorf("No snapshot %d.", (int)id);
+	}
+	check_bank_address(LM_Fe, bk, 0, MEMORY_SIZE - 1, true);
+
+	restore_snapshot(id, bk);
+
+	return fe_bool(ctx, 0);
+}
+
+static fe_Object *
+fe_frsnap(fe_Context *ctx, fe_Object *arg)
+{
+	size_t id = (size_t)fe_tonumber(ctx, fe_nextarg(ctx, &arg));
+
+	if (!snapshot_valid(id)) {
+		fe_errorf("No snapshot %d.", (int)id);
+	}
+
+	free_snapshot(id);
+
+	return fe_bool(ctx, 0);
+}
+
+const struct ApiFunc fe_apis[33] = {
 	{        "//",    fe_divide },
 	{         "%",   fe_modulus },
 	{      "quit",      fe_quit },
 	{      "rand",      fe_rand },
 	{      "poke",      fe_poke },
 	{      "peek",      fe_peek },
+	{     "peekl",     fe_peekl },
+	{    "peek16",    fe_peek16 },
+	{    "peek32",    fe_peek32 },
+	{    "poke16",    fe_poke16 },
+	{    "poke32",    fe_poke32 },
+	{    "memcpy",    fe_memcpy },
+	{   "memmove",    fe_memcpy },
+	{    "memset",    fe_memset },
 	{     "color",     fe_color },
 	{       "put",       fe_put },
+	{      "putc",      fe_putc },
 	{       "get",       fe_get },
 	{      "fill",      fe_fill },
+	{      "blit",      fe_blit },
+	{    "scroll",    fe_scroll },
 	{    "strlen",    fe_strlen },
 	{  "strstart",  fe_strstart },
 	{     "strat",     fe_strat },
@@ -283,4 +543,7 @@ const struct ApiFunc fe_apis[19] = {
 	{     "delay",     fe_delay },
 	{     "ticks",     fe_ticks },
 	{    "swibnk",    fe_swibnk },
+	{   "snapbnk",   fe_snapbnk },
+	{    "rstbnk",    fe_rstbnk },
+	{    "frsnap",    fe_frsnap },
 };
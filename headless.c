@@ -0,0 +1,308 @@
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+#include "vec.h"
+
+// Scripted input, one event per line, applied before the given tick runs:
+//
+//     <tick> key <name>                      keydown(name)
+//     <tick> mouse <button> <n> <x> <y>      mouse(button, n, x, y)
+//     <tick> motion <x> <y>                  mouse("motion", 1, x, y)
+//     <tick> wheel <dy>                      mouse("wheel", dy, 0, 0)
+//     <tick> quit
+//
+// Ticks count from zero, coordinates are in cells, and lines starting with
+// '#' are ignored. Events must be listed in order. They're queued up like
+// live input, and reach the script just before the next step.
+
+enum InputType {
+    IT_Key, IT_Mouse, IT_Quit,
+};
+
+struct ScriptedInput {
+    size_t tick;
+    enum InputType type;
+    char name[32];
+    double n, x, y;
+};
+
+typedef vec_t(struct ScriptedInput) vec_scripted_t;
+
+struct Headless headless = {0};
+
+// Installed by the allocation-counting wrappers that the bench binary is
+// linked with (see tools/alloc_count.c); NULL in the regular build.
+size_t (*alloc_counter)(void) = NULL;
+
+static vec_scripted_t input;
+
+// Per-tick samples for the -b report, for ticks on which a step ran.
+static vec_double_t step_us;
+static vec_double_t draw_us;
+static vec_double_t allocs;
+
+// These are modified between setjmp() and a possible longjmp() back to it
+// from an fe error, so they can't be locals.
+static size_t tick = 0;
+static int next_input = 0;
+
+static void load_input(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        err(2, "Couldn't open input script '%s'", path);
+    }
+
+    char line[256];
+    size_t lineno = 0;
+    size_t last_tick = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ++lineno;
+
+        char type[16] = {0};
+        int off = 0;
+        struct ScriptedInput ev = {0};
+
+        char *start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (sscanf(start, "%zu %15s %n", &ev.tick, type, &off) < 2)
+            errx(2, "%s:%zu: expected '<tick> <event> ...'\n", path, lineno);
+
+        char *args = start + off;
+        _Bool ok = true;
+
+        if (!strcmp(type, "key")) {
+            ev.type = IT_Key;
+            ok = sscanf(args, "%31s", ev.name) == 1;
+        } else if (!strcmp(type, "mouse")) {
+            ev.type = IT_Mouse;
+            ok = sscanf(args, "%31s %lf %lf %lf", ev.name, &ev.n, &ev.x, &ev.y) == 4;
+        } else if (!strcmp(type, "motion")) {
+            ev.type = IT_Mouse;
+            strcpy(ev.name, "motion");
+            ev.n = 1;
+            ok = sscanf(args, "%lf %lf", &ev.x, &ev.y) == 2;
+        } else if (!strcmp(type, "wheel")) {
+            ev.type = IT_Mouse;
+            strcpy(ev.name, "wheel");
+            ok = sscanf(args, "%lf", &ev.n) == 1;
+        } else if (!strcmp(type, "quit")) {
+            ev.type = IT_Quit;
+        } else {
+            errx(2, "%s:%zu: unknown event '%s'\n", path, lineno, type);
+        }
+
+        if (!ok)
+            errx(2, "%s:%zu: bad arguments for '%s'\n", path, lineno, type);
+        if (ev.tick < last_tick)
+            errx(2, "%s:%zu: events are out of order\n", path, lineno);
+
+        last_tick = ev.tick;
+        vec_push(&input, ev);
+    }
+
+    fclose(fp);
+}
+
+static void dispatch_input(void) {
+    for (; next_input < input.length; ++next_input) {
+        struct ScriptedInput *ev = &input.data[next_input];
+        if (ev->tick > tick)
+            break;
+
+        switch (ev->type) {
+        case IT_Key:
+            input_key(ev->name);
+            break;
+        case IT_Mouse:
+            if (!strcmp(ev->name, "motion"))
+                input_motion(ev->x, ev->y);
+            else if (!strcmp(ev->name, "wheel"))
+                input_wheel(ev->n);
+            else
+                input_button(ev->name, ev->n, ev->x, ev->y);
+            break;
+        case IT_Quit:
+            quit = true;
+            break;
+        }
+    }
+}
+
+// Write out the final frame: a binary PPM of the framebuffer, or the raw
+// bytes of the display's cells.
+static void write_output(const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        err(2, "Couldn't open '%s'", path);
+    }
+
+    if (headless.cells_only) {
+        size_t cells = MIN(config.width * config.height, DISPLAY_CELLS);
+        fwrite(&memory[bank][DISPLAY_START], 2, cells, fp);
+    } else {
+        size_t width  = config.width * FONT_WIDTH;
+        size_t height = config.height * FONT_HEIGHT;
+
+        fprintf(fp, "P6\n%zu %zu\n255\n", width, height);
+        for (size_t i = 0; i < width * height; ++i) {
+            uint8_t rgb[3] = {
+                (framebuffer[i] >> 24) & 0xFF,
+                (framebuffer[i] >> 16) & 0xFF,
+                (framebuffer[i] >>  8) & 0xFF,
+            };
+            fwrite(rgb, sizeof(rgb), 1, fp);
+        }
+    }
+
+    fclose(fp);
+}
+
+static double elapsed_us(uint64_t since) {
+    uint64_t now = SDL_GetPerformanceCounter();
+    return (double)(now - since) * 1000000 / SDL_GetPerformanceFrequency();
+}
+
+static size_t count_allocs(void) {
+    return alloc_counter != NULL ? alloc_counter() : 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void write_percentiles(FILE *fp, const char *name, vec_double_t *v) {
+    double p50 = 0, p99 = 0, max = 0;
+
+    if (v->length > 0) {
+        vec_sort(v, compare_doubles);
+        p50 = v->data[(v->length - 1) * 50 / 100];
+        p99 = v->data[(v->length - 1) * 99 / 100];
+        max = v->data[v->length - 1];
+    }
+
+    fprintf(fp, ",\"%s\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}", name, p50, p99, max);
+}
+
+// Append the benchmark results as a single line of JSON.
+static void write_bench(const char *path) {
+    FILE *fp = fopen(path, "a");
+    if (fp == NULL) {
+        err(2, "Couldn't open '%s'", path);
+    }
+
+    long peak_rss_kb = -1;
+#if defined(__linux__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        peak_rss_kb = usage.ru_maxrss;
+#endif
+
+    // The path is written as a JSON string, so quotes, backslashes and
+    // control characters in it are escaped.
+    fputs("{\"cartridge\":\"", fp);
+    for (const char *c = headless.cartridge ? headless.cartridge : ""; *c; ++c) {
+        if ((unsigned char)*c < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char)*c);
+            continue;
+        }
+        if (*c == '"' || *c == '\\') fputc('\\', fp);
+        fputc(*c, fp);
+    }
+    // Steps counts the builtin screens' steps too, cartridge_steps only the
+    // cartridge's own.
+    fprintf(fp, "\",\"ticks\":%zu,\"steps\":%zu,\"cartridge_steps\":%zu,\"error\":%s",
+        tick, sched.steps, mode.steps[MT_Normal], mode.cur == MT_Error ? "true" : "false");
+    write_percentiles(fp, "step_us", &step_us);
+    write_percentiles(fp, "draw_us", &draw_us);
+    if (alloc_counter != NULL)
+        write_percentiles(fp, "allocs", &allocs);
+    if (lang == LM_Fe) {
+        fprintf(fp, ",\"fe_heap\":{\"size\":%zu,\"collections\":%zu,\"restarts\":%zu}",
+            fe_heap.size, fe_heap.collections, fe_heap.restarts);
+    }
+    fprintf(fp, ",\"startup_ms\":%.3f,\"peak_rss_kb\":%ld}\n", startup_ms, peak_rss_kb);
+
+    fclose(fp);
+}
+
+// Run for headless.ticks ticks of a virtual clock, as fast as possible, with
+// no SDL video. Returns the exit status: 0 if the cartridge ran (or quit)
+// normally, 1 if it ended up on the error screen.
+int run_headless(void) {
+    SDL_Rect dirty;
+
+    vec_init(&input);
+    vec_init(&step_us);
+    vec_init(&draw_us);
+    vec_init(&allocs);
+
+    if (headless.input != NULL)
+        load_input(headless.input);
+
+    sched.virtual_clock = true;
+    sched_init(config.fps);
+
+    for (tick = 0; tick < headless.ticks && !quit; ++tick) {
+        if (setjmp(fe_error_recover) == 1) {
+            if (!restart_cartridge())
+                mode.cur = MT_Error;
+            continue;
+        }
+
+        dispatch_input();
+
+        sched_advance();
+        size_t due = sched_due();
+        if (due == 0)
+            continue;
+
+        size_t allocs_before = count_allocs();
+        uint64_t start = SDL_GetPerformanceCounter();
+
+        input_flush();
+        for (size_t i = 0; i < due && !quit && !sched_holding(); ++i) {
+            step();
+        }
+
+        if (headless.bench != NULL)
+            vec_push(&step_us, elapsed_us(start));
+
+        if (!headless.cells_only) {
+            start = SDL_GetPerformanceCounter();
+            render(&dirty);
+
+            if (headless.bench != NULL)
+                vec_push(&draw_us, elapsed_us(start));
+        }
+
+        if (headless.bench != NULL)
+            vec_push(&allocs, (double)(count_allocs() - allocs_before));
+    }
+
+    if (!headless.cells_only)
+        render(&dirty);
+
+    if (headless.output != NULL)
+        write_output(headless.output);
+    if (headless.bench != NULL)
+        write_bench(headless.bench);
+
+    vec_deinit(&input);
+    vec_deinit(&step_us);
+    vec_deinit(&draw_us);
+    vec_deinit(&allocs);
+
+    return mode.cur == MT_Error ? 1 : 0;
+}
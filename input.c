@@ -0,0 +1,117 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cel7ce.h"
+
+// Input is queued up as it arrives and handed to the script once per frame,
+// just before the step, by input_flush(). Key presses and mouse buttons are
+// kept in order; mouse motion between them is collapsed into its latest
+// position, and wheel movement into one total. The queue has a fixed size and
+// anything past that is dropped, so a frame never makes more than
+// MAX_INPUT_EVENTS callback calls (or one, with an `events` callback).
+
+#define MAX_INPUT_EVENTS 32
+
+static struct InputEvent queue[MAX_INPUT_EVENTS];
+static size_t queued = 0;
+static size_t dropped = 0;
+
+static _Bool motion_pending = false;
+static double motion_x, motion_y;
+
+static _Bool wheel_pending = false;
+static double wheel_dy;
+
+static void push(enum InputKind kind, const char *name, double n, double x, double y) {
+    if (queued == MAX_INPUT_EVENTS) {
+        ++dropped;
+        return;
+    }
+
+    struct InputEvent *ev = &queue[queued++];
+    ev->kind = kind;
+    strncpy(ev->name, name, sizeof(ev->name) - 1);
+    ev->name[sizeof(ev->name) - 1] = '\0';
+    ev->n = n;
+    ev->x = x;
+    ev->y = y;
+}
+
+// Queue any pending motion and wheel movement, so that they come before the
+// next discrete event.
+static void commit_pending(void) {
+    if (motion_pending)
+        push(IK_Mouse, "motion", 1, motion_x, motion_y);
+    if (wheel_pending)
+        push(IK_Mouse, "wheel", wheel_dy, 0, 0);
+
+    motion_pending = wheel_pending = false;
+    wheel_dy = 0;
+}
+
+void input_key(const char *name) {
+    commit_pending();
+    push(IK_Key, name, 0, 0, 0);
+}
+
+void input_text(const char *text) {
+    commit_pending();
+    push(IK_Text, text, 0, 0, 0);
+}
+
+void input_button(const char *button, double n, double x, double y) {
+    commit_pending();
+    push(IK_Mouse, button, n, x, y);
+}
+
+void input_motion(double x, double y) {
+    motion_pending = true;
+    motion_x = x;
+    motion_y = y;
+}
+
+void input_wheel(double dy) {
+    wheel_pending = true;
+    wheel_dy += dy;
+}
+
+// Send everything that's queued up to the script.
+void input_flush(void) {
+    static struct InputEvent events[MAX_INPUT_EVENTS];
+
+    commit_pending();
+
+    if (dropped > 0 && config.debug)
+        log_message("input: dropped %zu events\n", dropped);
+    dropped = 0;
+
+    if (queued == 0)
+        return;
+
+    // Empty the queue first: a callback may fail and never return here.
+    size_t count = queued;
+    memcpy(events, queue, count * sizeof(*events));
+    queued = 0;
+
+    if (send_events(events, count))
+        return;
+
+    for (size_t i = 0; i < count; ++i) {
+        struct InputEvent *ev = &events[i];
+
+        switch (ev->kind) {
+        case IK_Key:
+            send_keydown(ev->name);
+            break;
+        case IK_Text:
+            // Text input has always gone to the cartridge's own keydown,
+            // whatever the mode.
+            call_func("keydown", "s", ev->name);
+            break;
+        case IK_Mouse:
+            send_mouse(ev->name, ev->n, ev->x, ev->y);
+            break;
+        }
+    }
+}
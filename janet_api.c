@@ -1,5 +1,4 @@
 #include <math.h>
-#include <sys/time.h>
 
 #include "cel7ce.h"
 #include "janet.h"
@@ -61,7 +60,7 @@ janet_rand(int32_t argc, Janet *argv)
 		janet_panicf("Expected non-zero argument.");
 	}
 
-	return janet_wrap_number((double)(rand() % n));
+	return janet_wrap_number((double)(rng_next() % n));
 }
 
 static Janet
@@ -74,11 +73,15 @@ janet_poke(int32_t argc, Janet *argv)
 	if (janet_checktype(argv[1], JANET_STRING)) {
 		JanetString str = janet_getstring(argv, 1);
 		check_user_address(LM_Janet, addr, janet_string_length(str), true);
+		bank_will_write(bank, addr, janet_string_length(str));
 		memcpy(&memory[bank][addr], str, janet_string_length(str));
+		mark_dirty(bank, addr, janet_string_length(str));
 	} else if (janet_checktype(argv[1], JANET_NUMBER)) {
 		check_user_address(LM_Janet, addr, 1, true);
 		size_t byte = (uint8_t)janet_getnumber(argv, 1);
+		bank_will_write(bank, addr, 1);
 		memory[bank][addr] = byte;
+		mark_dirty(bank, addr, 1);
 	} else {
 		janet_panicf("bad slot #1, expected %T or %T, got %v",
 			JANET_STRING, JANET_NUMBER, argv[1]);
@@ -109,6 +112,252 @@ janet_peek(int32_t argc, Janet *argv)
 	}
 }
 
+// (memcpy dst-bank dst src-bank src n). Overlapping ranges are fine, so this
+// is memmove as well.
+static Janet
+janet_memcpy(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 5);
+
+	size_t dbk = (size_t)janet_getnumber(argv, 0);
+	size_t dst = (size_t)janet_getnumber(argv, 1);
+	size_t sbk = (size_t)janet_getnumber(argv, 2);
+	size_t src = (size_t)janet_getnumber(argv, 3);
+	size_t sz  = (size_t)janet_getnumber(argv, 4);
+
+	check_bank_address(LM_Janet, sbk, src, sz, false);
+	check_bank_address(LM_Janet, dbk, dst, sz, true);
+
+	bank_will_write(dbk, dst, sz);
+	memmove(&memory[dbk][dst], &memory[sbk][src], sz);
+	mark_dirty(dbk, dst, sz);
+
+	return janet_wrap_nil();
+}
+
+// (memset bank addr byte n)
+static Janet
+janet_memset(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 4);
+
+	size_t bk   = (size_t)janet_getnumber(argv, 0);
+	size_t addr = (size_t)janet_getnumber(argv, 1);
+	uint8_t byte = (uint8_t)janet_getnumber(argv, 2);
+	size_t sz   = (size_t)janet_getnumber(argv, 3);
+
+	check_bank_address(LM_Janet, bk, addr, sz, true);
+
+	bank_will_write(bk, addr, sz);
+	memset(&memory[bk][addr], byte, sz);
+	mark_dirty(bk, addr, sz);
+
+	return janet_wrap_nil();
+}
+
+// ----------------------------------------------------------------------------
+// Views: a live window onto a region of a bank, indexed like a buffer, so that
+// memory can be read and written without peek/poke copying it back and forth.
+//
+// (view bank addr n) makes one. Methods: :length, :slice, :fill, :bytes.
+// (length v) works too: Janet finds the :length method through view_get().
+//
+// The bank a view is onto can go away after it's made, when the cartridge
+// asks for fewer banks, so it's checked again on every access.
+
+struct View {
+	size_t bank;
+	size_t addr;
+	size_t len;
+};
+
+static Janet
+make_view(size_t bk, size_t addr, size_t len)
+{
+	struct View *v = janet_abstract(&janet_view_type, sizeof(struct View));
+	v->bank = bk;
+	v->addr = addr;
+	v->len = len;
+	return janet_wrap_abstract(v);
+}
+
+static size_t
+view_index(struct View *v, Janet key)
+{
+	if (!janet_checkint(key))
+		janet_panicf("expected integer index, got %v", key);
+
+	int32_t i = janet_unwrap_integer(key);
+	if (i < 0 || (size_t)i >= v->len)
+		janet_panicf("index %d out of range [0, %d)", i, (int32_t)v->len);
+
+	return (size_t)i;
+}
+
+static void
+view_check(struct View *v)
+{
+	check_bank_address(LM_Janet, v->bank, v->addr, v->len, false);
+}
+
+static Janet
+view_length(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 1);
+	struct View *v = janet_getabstract(argv, 0, &janet_view_type);
+	return janet_wrap_number((double)v->len);
+}
+
+// (:slice view start &opt end), with negative indices counting from the end,
+// as with string/slice.
+static Janet
+view_slice(int32_t argc, Janet *argv)
+{
+	janet_arity(argc, 1, 3);
+	struct View *v = janet_getabstract(argv, 0, &janet_view_type);
+	view_check(v);
+
+	int32_t start = argc > 1 ? janet_gethalfrange(argv, 1, (int32_t)v->len, "start") : 0;
+	int32_t end = argc > 2 ? janet_gethalfrange(argv, 2, (int32_t)v->len, "end") : (int32_t)v->len;
+	if (end < start)
+		end = start;
+
+	return make_view(v->bank, v->addr + start, end - start);
+}
+
+static Janet
+view_fill(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 2);
+	struct View *v = janet_getabstract(argv, 0, &janet_view_type);
+	uint8_t byte = (uint8_t)janet_getnumber(argv, 1);
+
+	check_bank_address(LM_Janet, v->bank, v->addr, v->len, true);
+	bank_will_write(v->bank, v->addr, v->len);
+	memset(&memory[v->bank][v->addr], byte, v->len);
+	mark_dirty(v->bank, v->addr, v->len);
+
+	return argv[0];
+}
+
+// Copy the region out into a string, as (peek addr n) would.
+static Janet
+view_bytes(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 1);
+	struct View *v = janet_getabstract(argv, 0, &janet_view_type);
+	view_check(v);
+	return janet_stringv(&memory[v->bank][v->addr], v->len);
+}
+
+static const JanetMethod view_methods[] = {
+	{ "length", view_length },
+	{  "slice",  view_slice },
+	{   "fill",   view_fill },
+	{  "bytes",  view_bytes },
+	{     NULL,        NULL },
+};
+
+static int
+view_get(void *p, Janet key, Janet *out)
+{
+	struct View *v = p;
+
+	if (janet_checktype(key, JANET_KEYWORD))
+		return janet_getmethod(janet_unwrap_keyword(key), view_methods, out);
+
+	view_check(v);
+	*out = janet_wrap_number((double)memory[v->bank][v->addr + view_index(v, key)]);
+	return 1;
+}
+
+static void
+view_put(void *p, Janet key, Janet value)
+{
+	struct View *v = p;
+	size_t addr = v->addr + view_index(v, key);
+
+	if (!janet_checktype(value, JANET_NUMBER))
+		janet_panicf("expected number, got %v", value);
+
+	check_bank_address(LM_Janet, v->bank, addr, 1, true);
+	bank_will_write(v->bank, addr, 1);
+	memory[v->bank][addr] = (uint8_t)janet_unwrap_number(value);
+	mark_dirty(v->bank, addr, 1);
+}
+
+static Janet
+view_next(void *p, Janet key)
+{
+	struct View *v = p;
+	view_check(v);
+
+	if (janet_checktype(key, JANET_NIL))
+		return v->len > 0 ? janet_wrap_integer(0) : janet_wrap_nil();
+
+	size_t i = view_index(v, key) + 1;
+	return i < v->len ? janet_wrap_integer((int32_t)i) : janet_wrap_nil();
+}
+
+static void
+view_tostring(void *p, JanetBuffer *buf)
+{
+	struct View *v = p;
+	char str[48];
+	snprintf(str, sizeof(str), "[%zu]0x%04zX...%04zX", v->bank, v->addr, v->addr + v->len);
+	janet_buffer_push_cstring(buf, str);
+}
+
+static void
+view_marshal(void *p, JanetMarshalContext *ctx)
+{
+	struct View *v = p;
+	janet_marshal_abstract(ctx, p);
+	janet_marshal_size(ctx, v->bank);
+	janet_marshal_size(ctx, v->addr);
+	janet_marshal_size(ctx, v->len);
+}
+
+static void *
+view_unmarshal(JanetMarshalContext *ctx)
+{
+	struct View *v = janet_unmarshal_abstract(ctx, sizeof(struct View));
+	v->bank = janet_unmarshal_size(ctx);
+	v->addr = janet_unmarshal_size(ctx);
+	v->len = janet_unmarshal_size(ctx);
+	check_bank_address(LM_Janet, v->bank, v->addr, v->len, false);
+	return v;
+}
+
+const JanetAbstractType janet_view_type = {
+	"cel7/view",
+	NULL,
+	NULL,
+	view_get,
+	view_put,
+	view_marshal,
+	view_unmarshal,
+	view_tostring,
+	NULL,
+	NULL,
+	view_next,
+	JANET_ATEND_NEXT
+};
+
+static Janet
+janet_view(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 3);
+
+	size_t bk = (size_t)janet_getnumber(argv, 0);
+	size_t addr = (size_t)janet_getnumber(argv, 1);
+	size_t sz = (size_t)janet_getnumber(argv, 2);
+
+	check_bank_address(LM_Janet, bk, addr, sz, false);
+
+	return make_view(bk, addr, sz);
+}
+
 static Janet
 janet_color(int32_t argc, Janet *argv)
 {
@@ -117,6 +366,8 @@ janet_color(int32_t argc, Janet *argv)
 	return janet_wrap_nil();
 }
 
+// (c7put x y str...): write each string's bytes, newlines included, one
+// after the other along row y.
 static Janet
 janet_cel7put(int32_t argc, Janet *argv)
 {
@@ -126,21 +377,52 @@ janet_cel7put(int32_t argc, Janet *argv)
 		janet_panicf("Cannot write to bank.");
 	}
 
-	size_t sx = (size_t)janet_getnumber(argv, 0);
-	size_t sy = (size_t)janet_getnumber(argv, 1);
+	long x = (long)janet_getnumber(argv, 0);
+	long y = (long)janet_getnumber(argv, 1);
+
+	for (int32_t arg = 2; arg < argc; ++arg) {
+		const uint8_t *str = janet_getstring(argv, arg);
+		size_t sz = strlen((const char *)str);
+		put_row(x, y, str, sz, NULL, 0);
+		x += sz;
+	}
+
+	return janet_wrap_nil();
+}
+
+// (c7putc x y str attrs): c7put, with an attribute per character, from a
+// string, a buffer or an array of numbers. Newlines in str start a new row.
+static Janet
+janet_cel7putc(int32_t argc, Janet *argv)
+{
+	static uint8_t buf[MEMORY_SIZE];
+
+	janet_fixarity(argc, 4);
+
+	if (bank == BK_Rom) {
+		janet_panicf("Cannot write to bank.");
+	}
+
+	long x = (long)janet_getnumber(argv, 0);
+	long y = (long)janet_getnumber(argv, 1);
+	JanetByteView chars = janet_getbytes(argv, 2);
+
+	const uint8_t *attrs;
+	const Janet *items;
+	int32_t nattrs;
 
-	for (size_t x = sx, arg = 2; arg < (size_t)argc; ++arg) {
-		char *str = (char *)janet_getstring(argv, arg);
-		size_t sz = strlen(str);
+	if (!janet_bytes_view(argv[3], &attrs, &nattrs)) {
+		if (!janet_indexed_view(argv[3], &items, &nattrs))
+			janet_panicf("bad slot #3, expected bytes or indexed, got %v", argv[3]);
 
-		for (size_t i = 0; i < sz && x < config.width; ++i, ++x) {
-			size_t coord = sy * config.width + x;
-			size_t addr = DISPLAY_START + (coord * 2);
-			memory[BK_Normal][addr + 0] = str[i];
-			memory[BK_Normal][addr + 1] = color;
-		}
+		nattrs = MIN(nattrs, (int32_t)sizeof(buf));
+		for (int32_t i = 0; i < nattrs; ++i)
+			buf[i] = (uint8_t)janet_getnumber(items, i);
+		attrs = buf;
 	}
 
+	put_cells(x, y, chars.bytes, chars.len, attrs, nattrs);
+
 	return janet_wrap_nil();
 }
 
@@ -149,11 +431,15 @@ janet_cel7get(int32_t argc, Janet *argv)
 {
 	janet_fixarity(argc, 2);
 
-	size_t x = (size_t)janet_getnumber(argv, 0);
-	size_t y = (size_t)janet_getnumber(argv, 1);
+	long x = (long)janet_getnumber(argv, 0);
+	long y = (long)janet_getnumber(argv, 1);
+
+	int glyph = get_cell(x, y);
+	if (glyph < 0) {
+		janet_panicf("Cell (%d, %d) is off the display.", x, y);
+	}
 
-	uint8_t res = memory[BK_Normal][y * config.width + x + 0];
-	return janet_wrap_number((double)res);
+	return janet_wrap_number((double)glyph);
 }
 
 static Janet
@@ -165,25 +451,69 @@ janet_fill(int32_t argc, Janet *argv)
 		janet_panicf("Cannot write to bank.");
 	}
 
-	size_t x = (size_t)janet_getnumber(argv, 0);
-	size_t y = (size_t)janet_getnumber(argv, 1);
-	size_t w = (size_t)janet_getnumber(argv, 2);
-	size_t h = (size_t)janet_getnumber(argv, 3);
+	long x = (long)janet_getnumber(argv, 0);
+	long y = (long)janet_getnumber(argv, 1);
+	long w = (long)janet_getnumber(argv, 2);
+	long h = (long)janet_getnumber(argv, 3);
 
 	const uint8_t *str = janet_getstring(argv, 4);
 	if (strlen((char *)str) != 1)
 		janet_panicf("bad slot #5, expected a string with one character");
-	size_t c = str[0];
-
-	for (size_t dy = y; dy < (y + h); ++dy) {
-		for (size_t dx = x; dx < (x + w); ++dx) {
-			size_t coord = dy * config.width + dx;
-			size_t addr = DISPLAY_START + (coord * 2);
-			memory[BK_Normal][addr + 0] = c;
-			memory[BK_Normal][addr + 1] = color;
-		}
+
+	fill_cells(x, y, w, h, str[0], color);
+
+	return janet_wrap_nil();
+}
+
+// (blit x y w h sx sy &opt bank): copy the w*h cells at (sx, sy) to (x, y).
+// The source is the display of the given bank, or of the current one.
+static Janet
+janet_blit(int32_t argc, Janet *argv)
+{
+	janet_arity(argc, 6, 7);
+
+	if (bank == BK_Rom) {
+		janet_panicf("Cannot write to bank.");
+	}
+
+	long x = (long)janet_getnumber(argv, 0);
+	long y = (long)janet_getnumber(argv, 1);
+	long w = (long)janet_getnumber(argv, 2);
+	long h = (long)janet_getnumber(argv, 3);
+	long sx = (long)janet_getnumber(argv, 4);
+	long sy = (long)janet_getnumber(argv, 5);
+	size_t sbk = (size_t)janet_optnumber(argv, argc, 6, bank);
+
+	check_bank_address(LM_Janet, sbk, DISPLAY_START, DISPLAY_CELLS * 2, false);
+	blit_cells(x, y, w, h, sbk, sx, sy);
+
+	return janet_wrap_nil();
+}
+
+// (scroll dx dy &opt char): shift the display, filling in behind it with char
+// (or spaces) in the current color.
+static Janet
+janet_scroll(int32_t argc, Janet *argv)
+{
+	janet_arity(argc, 2, 3);
+
+	if (bank == BK_Rom) {
+		janet_panicf("Cannot write to bank.");
 	}
 
+	long dx = (long)janet_getnumber(argv, 0);
+	long dy = (long)janet_getnumber(argv, 1);
+
+	uint8_t c = ' ';
+	if (argc > 2) {
+		const uint8_t *str = janet_getstring(argv, 2);
+		if (janet_string_length(str) != 1)
+			janet_panicf("bad slot #3, expected a string with one character");
+		c = str[0];
+	}
+
+	scroll_cells(dx, dy, c, color);
+
 	return janet_wrap_nil();
 }
 
@@ -207,9 +537,7 @@ janet_delay(int32_t argc, Janet *argv)
 		janet_panicf("Delay %f invalid.", delay);
 	}
 
-	delay_val.tv_sec  = (time_t)round(delay);
-	delay_val.tv_usec = (suseconds_t)((delay - round(delay)) * 1000000);
-	gettimeofday(&delay_set, NULL);
+	sched_delay(delay);
 
 	return janet_wrap_nil();
 }
@@ -229,16 +557,71 @@ janet_swibnk(int32_t argc, Janet *argv)
 
 	double bank_arg = janet_getnumber(argv, 0);
 
-	if (bank_arg < 0 || bank_arg > BK_COUNT) {
+	if (bank_arg < 0 || bank_arg >= bank_count) {
 		janet_panicf("Cannot switch to bank %.f.", bank_arg);
 	}
 
+	if (bank != (size_t)bank_arg)
+		mark_all_dirty();
 	bank = (size_t)bank_arg;
 
 	return janet_wrap_nil();
 }
 
-const struct JanetReg janet_apis[16] = {
+// (snapbnk bank): snapshot a bank, returning the snapshot's id. Nothing is
+// copied until the bank is written to.
+static Janet
+janet_snapbnk(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 1);
+
+	size_t bk = (size_t)janet_getnumber(argv, 0);
+	check_bank_address(LM_Janet, bk, 0, 1, false);
+
+	ssize_t id = snapshot_bank(bk);
+	if (id < 0) {
+		janet_panicf("Too many snapshots.");
+	}
+
+	return janet_wrap_number((double)id);
+}
+
+// (rstbnk id bank): copy a snapshot back into a bank.
+static Janet
+janet_rstbnk(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 2);
+
+	size_t id = (size_t)janet_getnumber(argv, 0);
+	size_t bk = (size_t)janet_getnumber(argv, 1);
+
+	if (!snapshot_valid(id)) {
+		janet_panicf("No snapshot %d.", (int)id);
+	}
+	check_bank_address(LM_Janet, bk, 0, MEMORY_SIZE - 1, true);
+
+	restore_snapshot(id, bk);
+
+	return janet_wrap_nil();
+}
+
+static Janet
+janet_frsnap(int32_t argc, Janet *argv)
+{
+	janet_fixarity(argc, 1);
+
+	size_t id = (size_t)janet_getnumber(argv, 0);
+
+	if (!snapshot_valid(id)) {
+		janet_panicf("No snapshot %d.", (int)id);
+	}
+
+	free_snapshot(id);
+
+	return janet_wrap_nil();
+}
+
+const struct JanetReg janet_apis[26] = {
 	{     "lderr",    janet_lderr, "" },
 	{     "swimd",    janet_swimd, "" },
 	{        "//",  janet_idivide, "" },
@@ -246,14 +629,24 @@ const struct JanetReg janet_apis[16] = {
 	{      "rand",     janet_rand, "" },
 	{      "poke",     janet_poke, "" },
 	{      "peek",     janet_peek, "" },
+	{    "memcpy",   janet_memcpy, "" },
+	{   "memmove",   janet_memcpy, "" },
+	{    "memset",   janet_memset, "" },
+	{      "view",     janet_view, "" },
 	{     "color",    janet_color, "" },
 	{     "c7put",  janet_cel7put, "" },
+	{    "c7putc", janet_cel7putc, "" },
 	{     "c7get",  janet_cel7get, "" },
 	{      "fill",     janet_fill, "" },
+	{      "blit",     janet_blit, "" },
+	{    "scroll",   janet_scroll, "" },
 	{  "username", janet_username, "" },
 	{     "delay",    janet_delay, "" },
 	{     "ticks",    janet_ticks, "" },
 	{    "swibnk",   janet_swibnk, "" },
+	{   "snapbnk",  janet_snapbnk, "" },
+	{    "rstbnk",   janet_rstbnk, "" },
+	{    "frsnap",   janet_frsnap, "" },
 
 	// Include a null sentinel, because janet_cfunc is too braindamaged
 	// to take a "sz" parameter.
@@ -0,0 +1,268 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cel7ce.h"
+#include "fe.h"
+#include "janet.h"
+
+// Machine state shared by the cel7 binary and the tools linked against it,
+// along with the setup and teardown of memory and the interpreters.
+
+static uint32_t colors[] = {
+    0x0b0c0d, 0xf7f7e6, 0xf71467, 0xfd971f,
+    0xe6d415, 0xa0e01f, 0x46bbff, 0xa98aff,
+    0xf9aaaf, 0xab3347, 0x37946e, 0x2a4669,
+    0x7c8d99, 0xc2beae, 0x75715e, 0x3e3d32
+};
+
+struct Config config = {
+    .title = "cel7 ce",
+    .width = 24,
+    .height = 16,
+    .scale = 4,
+    .fps = DEFAULT_FPS,
+    .replay = 60,
+    .heap = FE_CTX_DATA_SIZE,
+    .banks = BK_COUNT,
+    .debug = false,
+};
+
+struct Mode mode = {
+    .cur = MT_Start,
+    .inited = {0},
+};
+_Bool load_error = false;
+
+enum LangMode lang = LM_Fe;
+
+uint8_t *memory[BANKS_MAX] = {0};
+size_t bank = BK_Normal;
+uint8_t color = 1;
+
+// The state of the scripts' `rand`. It's part of the machine state, unlike
+// libc's rand(), so that it can be saved and restored along with memory.
+uint64_t rng_state = 0;
+
+JanetTable *janet_env;
+void *fe_ctx_data = NULL;
+fe_Context *fe_ctx = NULL;
+struct FeHeap fe_heap = {0};
+bool quit = false;
+
+jmp_buf fe_error_recover;
+
+static void _fe_error(fe_Context *ctx, const char *err, fe_Object *cl) {
+    if (!strcmp(err, "out of memory"))
+        fe_heap.exhausted = true;
+
+    log_message("fe error: %s\n", err);
+    for (; !fe_isnil(ctx, cl); cl = fe_cdr(ctx, cl)) {
+        char buf[128];
+        fe_tostring(ctx, fe_car(ctx, cl), buf, ARRAY_LEN(buf));
+        log_message("=> %s\n", buf);
+    }
+    longjmp(fe_error_recover, 1);
+}
+
+// Bound to a symbol, so that it's reachable, and marked on every collection.
+static int gc_sentinel;
+
+static fe_Object *_fe_mark(fe_Context *ctx, fe_Object *obj) {
+    if (fe_toptr(ctx, obj) == &gc_sentinel)
+        ++fe_heap.collections;
+    return NULL;
+}
+
+static void open_fe(size_t size) {
+    fe_ctx_data = ecalloc(size, sizeof(uint8_t));
+    fe_ctx = fe_open(fe_ctx_data, size);
+
+    fe_heap.size = size;
+    fe_heap.collections = 0;
+    fe_heap.exhausted = false;
+
+    // Each binding is reachable from its symbol once it's set, so none of
+    // them have to stay on fe's GC stack, which only has room for 256.
+    for (size_t i = 0; i < ARRAY_LEN(fe_apis); ++i) {
+        int gc = fe_savegc(fe_ctx);
+        fe_set(fe_ctx, fe_symbol(fe_ctx, fe_apis[i].name), fe_cfunc(fe_ctx, fe_apis[i].func));
+        fe_restoregc(fe_ctx, gc);
+    }
+
+    fe_Handlers *hnds = fe_handlers(fe_ctx);
+    assert(hnds != NULL);
+    hnds->error = _fe_error;
+    hnds->mark = _fe_mark;
+
+    fe_set(fe_ctx, fe_symbol(fe_ctx, "%gc-sentinel"), fe_ptr(fe_ctx, &gc_sentinel));
+}
+
+static void close_fe(void) {
+    fe_close(fe_ctx);
+    free(fe_ctx_data);
+
+    fe_ctx = NULL;
+    fe_ctx_data = NULL;
+}
+
+void init_vm(void) {
+    // Initialize Janet
+    janet_init();
+    janet_env = janet_core_env(NULL);
+    janet_cfuns(janet_env, "cel7", janet_apis);
+    janet_register_abstract_type(&janet_view_type);
+
+    // Initialize fe
+    open_fe(MIN(MAX(config.heap, FE_CTX_DATA_SIZE), FE_HEAP_MAX));
+
+    reset_call_cache();
+}
+
+// fe's heap is one fixed-size arena, which can't be grown in place. Instead,
+// fe is started over with a bigger one, losing everything in it; the caller
+// has to set_vals() and load the cartridge again. Returns false if size is
+// past FE_HEAP_MAX.
+_Bool restart_fe(size_t size) {
+    if (size > FE_HEAP_MAX)
+        return false;
+
+    if (config.debug) {
+        log_message("fe: restarting with a %zu byte heap (was %zu, %zu collections)\n",
+            size, fe_heap.size, fe_heap.collections);
+    }
+
+    close_fe();
+    open_fe(size);
+    ++fe_heap.restarts;
+    config.heap = size;
+
+    reset_fe_call_cache();
+    return true;
+}
+
+void rng_seed(uint64_t seed) {
+    rng_state = seed;
+}
+
+// splitmix64.
+uint32_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (z ^ (z >> 31)) >> 32;
+}
+
+void init_mem(void) {
+    memory[BK_Normal] = ecalloc(MEMORY_SIZE, sizeof(uint8_t));
+    memory[BK_Rom]    = ecalloc(MEMORY_SIZE, sizeof(uint8_t));
+
+    // Initialize colors.
+    for (size_t i = 0; i < ARRAY_LEN(colors); ++i) {
+        size_t addr = PALETTE_START + (i * 4);
+        for (size_t b = 0; b < 4; ++b) {
+            size_t byte = colors[i] >> (b * 8);
+            memory[BK_Rom][addr + b] = byte & 0xFF;
+        }
+    }
+
+    // Initialize fonts.
+    for (size_t i = 0; i < ARRAY_LEN(font); ++i) {
+        for (size_t j = 0; j < FONT_WIDTH; ++j) {
+            size_t ch = font[i][j] == 'x' ? 1 : 0;
+            memory[BK_Rom][FONT_START + (i * FONT_WIDTH) + j] = ch;
+        }
+    }
+
+    // Initialize display portion of BK_Rom.
+    for (size_t i = DISPLAY_START; i < MEMORY_SIZE; ++i) {
+        memory[BK_Rom][i] = "BLACKLIVESMATTER"[i % 16];
+    }
+
+    // The renderer keeps its own copy of the fonts, which needs to be told
+    // about the writes above.
+    for (size_t i = 0; i < BK_COUNT; ++i)
+        mark_dirty(i, FONT_START, DISPLAY_START - FONT_START);
+}
+
+void set_vals(void) {
+    // Janet
+    {
+        Janet j_title = janet_stringv((const uint8_t *)config.title, strlen(config.title));
+        janet_def(janet_env, "title", j_title, "");
+
+        janet_def(janet_env, "width",  janet_wrap_number(config.width), "");
+        janet_def(janet_env, "height", janet_wrap_number(config.height), "");
+        janet_def(janet_env, "scale",  janet_wrap_number(config.scale), "");
+        janet_def(janet_env, "fps",    janet_wrap_number(config.fps), "");
+        janet_def(janet_env, "replay", janet_wrap_number(config.replay), "");
+        janet_def(janet_env, "banks",  janet_wrap_number(config.banks), "");
+        janet_def(janet_env, "debug",  janet_wrap_boolean(config.debug), "");
+    }
+
+    // Fe
+    {
+        int gc = fe_savegc(fe_ctx);
+        fe_Object *objs[3];
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "width");
+        objs[2] = fe_number(fe_ctx, config.width);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "height");
+        objs[2] = fe_number(fe_ctx, config.height);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "scale");
+        objs[2] = fe_number(fe_ctx, config.scale);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "fps");
+        objs[2] = fe_number(fe_ctx, config.fps);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "replay");
+        objs[2] = fe_number(fe_ctx, config.replay);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "banks");
+        objs[2] = fe_number(fe_ctx, config.banks);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        // Only fe has a fixed-size heap.
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "heap");
+        objs[2] = fe_number(fe_ctx, config.heap);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        objs[0] = fe_symbol(fe_ctx, "=");
+        objs[1] = fe_symbol(fe_ctx, "debug");
+        objs[2] = fe_bool(fe_ctx, config.debug);
+        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
+
+        fe_restoregc(fe_ctx, gc);
+    }
+}
+
+void deinit_mem(void) {
+    deinit_banks();
+    for (size_t i = 0; i < BK_COUNT; ++i)
+        free(memory[i]);
+}
+
+void deinit_vm(void) {
+    assert(fe_ctx != NULL);
+
+    close_fe();
+
+    janet_deinit();
+}
@@ -3,7 +3,6 @@
 #endif
 
 #include <assert.h>
-#include <gif_lib.h>
 #include <SDL.h>
 #include <setjmp.h>
 #include <stdbool.h>
@@ -19,19 +18,11 @@
 #include "koio.h"
 #include "fe.h"
 #include "janet.h"
-#include "vec.h"
 
 const char *builtin_files[] = {
     "builtin/start.janet", "builtin/setup.janet", "builtin/error.janet"
 };
 
-static uint32_t colors[] = {
-    0x0b0c0d, 0xf7f7e6, 0xf71467, 0xfd971f,
-    0xe6d415, 0xa0e01f, 0x46bbff, 0xa98aff,
-    0xf9aaaf, 0xab3347, 0x37946e, 0x2a4669,
-    0x7c8d99, 0xc2beae, 0x75715e, 0x3e3d32
-};
-
 static char *mouse_button_strs[] = {
     [SDL_BUTTON_LEFT]   = "left",
     [SDL_BUTTON_MIDDLE] = "middle",
@@ -40,159 +31,42 @@ static char *mouse_button_strs[] = {
 
 static char *callbacks[MT_COUNT][SC_COUNT] = {
     [MT_Start]  = { [SC_init]  = "I_START_init",  [SC_step] = "I_START_step",
-                [SC_keydown] = "I_START_keydown", [SC_mouse] = "I_START_mouse"
+                [SC_keydown] = "I_START_keydown", [SC_mouse] = "I_START_mouse",
+                [SC_events] = "I_START_events"
               },
     [MT_Setup]  = { [SC_init]  = "I_SETUP_init",  [SC_step] = "I_SETUP_step",
-                [SC_keydown] = "I_SETUP_keydown", [SC_mouse] = "I_SETUP_mouse"
+                [SC_keydown] = "I_SETUP_keydown", [SC_mouse] = "I_SETUP_mouse",
+                [SC_events] = "I_SETUP_events"
               },
     [MT_Normal] = { [SC_init]  = "init",  [SC_step] = "step",
-                [SC_keydown] = "keydown", [SC_mouse] = "mouse"
+                [SC_keydown] = "keydown", [SC_mouse] = "mouse",
+                [SC_events] = "events"
               },
     [MT_Error]  = { [SC_init]  = "I_ERROR_init",  [SC_step] = "I_ERROR_step",
-                [SC_keydown] = "I_ERROR_keydown", [SC_mouse] = "I_ERROR_mouse"
+                [SC_keydown] = "I_ERROR_keydown", [SC_mouse] = "I_ERROR_mouse",
+                [SC_events] = "I_ERROR_events"
               },
 };
 
-struct Config config = {
-    .title = "cel7 ce",
-    .width = 24,
-    .height = 16,
-    .scale = 4,
-    .debug = false,
-};
-
-struct Mode mode = {
-    .cur = MT_Start,
-    .inited = {0},
-};
-_Bool load_error = false;
-
-enum LangMode lang = LM_Fe;
-
-struct timeval delay_set = {0};
-struct timeval delay_val = {0};
-
-uint8_t *memory[BK_COUNT] = {0};
-size_t bank = BK_Normal;
-uint8_t color = 1;
-
-JanetTable *janet_env;
-void *fe_ctx_data = NULL;
-fe_Context *fe_ctx = NULL;
-bool quit = false;
+// The cartridge's path, or NULL if it's appended to the binary.
+static char *cartridge = NULL;
 
-jmp_buf fe_error_recover;
+// When main() started, and how long it took from there to the first step.
+static uint64_t startup_counter;
+double startup_ms = -1;
 
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
 
-static _Bool has_recording = false;
-static _Bool is_recording = false;
-static vec_void_t frames;
-
-static void log_message(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-}
-
-static void _fe_error(fe_Context *ctx, const char *err, fe_Object *cl) {
-    log_message("fe error: %s\n", err);
-    for (; !fe_isnil(ctx, cl); cl = fe_cdr(ctx, cl)) {
-        char buf[128];
-        fe_tostring(ctx, fe_car(ctx, cl), buf, ARRAY_LEN(buf));
-        log_message("=> %s\n", buf);
-    }
-    longjmp(fe_error_recover, 1);
-}
-
-static void init_vm(void) {
-    // Initialize Janet
-    janet_init();
-    janet_env = janet_core_env(NULL);
-    janet_cfuns(janet_env, "cel7", janet_apis);
-
-    // Initialize fe
-    fe_ctx_data = malloc(FE_CTX_DATA_SIZE);
-    fe_ctx = fe_open(fe_ctx_data, FE_CTX_DATA_SIZE);
-
-    for (size_t i = 0; i < ARRAY_LEN(fe_apis); ++i) {
-        fe_set(fe_ctx, fe_symbol(fe_ctx, fe_apis[i].name), fe_cfunc(fe_ctx, fe_apis[i].func));
-    }
-
-    fe_Handlers *hnds = fe_handlers(fe_ctx);
-    assert(hnds != NULL);
-    hnds->error = _fe_error;
-}
+// Set while the window is hidden or minimized, in which case there's no point
+// in rasterizing or presenting anything. The cartridge is paused meanwhile,
+// see run().
+static _Bool window_hidden = false;
+static _Bool needs_present = true;
 
-static void init_mem(void) {
-    memory[BK_Normal] = ecalloc(MEMORY_SIZE, sizeof(uint8_t));
-    memory[BK_Rom]    = ecalloc(MEMORY_SIZE, sizeof(uint8_t));
-
-    // Initialize colors.
-    for (size_t i = 0; i < ARRAY_LEN(colors); ++i) {
-        size_t addr = PALETTE_START + (i * 4);
-        for (size_t b = 0; b < 4; ++b) {
-            size_t byte = colors[i] >> (b * 8);
-            memory[BK_Rom][addr + b] = byte & 0xFF;
-        }
-    }
-
-    // Initialize fonts.
-    for (size_t i = 0; i < ARRAY_LEN(font); ++i) {
-        for (size_t j = 0; j < FONT_WIDTH; ++j) {
-            size_t ch = font[i][j] == 'x' ? 1 : 0;
-            memory[BK_Rom][FONT_START + (i * FONT_WIDTH) + j] = ch;
-        }
-    }
-
-    // Initialize display portion of BK_Rom.
-    for (size_t i = DISPLAY_START; i < MEMORY_SIZE; ++i) {
-        memory[BK_Rom][i] = "BLACKLIVESMATTER"[i % 16];
-    }
-}
-
-static void set_vals(void) {
-    // Janet
-    {
-        Janet j_title = janet_stringv((const uint8_t *)config.title, strlen(config.title));
-        janet_def(janet_env, "title", j_title, "");
-
-        janet_def(janet_env, "width",  janet_wrap_number(config.width), "");
-        janet_def(janet_env, "height", janet_wrap_number(config.height), "");
-        janet_def(janet_env, "scale",  janet_wrap_number(config.scale), "");
-        janet_def(janet_env, "debug",  janet_wrap_boolean(config.debug), "");
-    }
-
-    // Fe
-    {
-        fe_Object *objs[3];
-
-        objs[0] = fe_symbol(fe_ctx, "=");
-        objs[1] = fe_symbol(fe_ctx, "width");
-        objs[2] = fe_number(fe_ctx, config.width);
-        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
-
-        objs[0] = fe_symbol(fe_ctx, "=");
-        objs[1] = fe_symbol(fe_ctx, "height");
-        objs[2] = fe_number(fe_ctx, config.height);
-        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
-
-        objs[0] = fe_symbol(fe_ctx, "=");
-        objs[1] = fe_symbol(fe_ctx, "scale");
-        objs[2] = fe_number(fe_ctx, config.scale);
-        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
-
-        objs[0] = fe_symbol(fe_ctx, "=");
-        objs[1] = fe_symbol(fe_ctx, "debug");
-        objs[2] = fe_bool(fe_ctx, config.debug);
-        fe_eval(fe_ctx, fe_list(fe_ctx, objs, ARRAY_LEN(objs)));
-    }
-}
-
-static void load_builtins(void) {
+// Compile the builtin scripts from source, as bundled by koio.
+static void load_builtin_sources(void) {
     for (size_t i = 0; i < ARRAY_LEN(builtin_files); ++i) {
         FILE *df = ko_fopen(builtin_files[i], "r");
         assert(df != NULL);
@@ -208,34 +82,98 @@ static void load_builtins(void) {
     }
 }
 
-static void deinit_mem(void) {
-    for (size_t i = 0; i < BK_COUNT; ++i)
-        free(memory[i]);
+// What the builtin image's references to the environment resolve to. It's
+// made before the cartridge is loaded, so that a builtin the cartridge
+// redefines still means the builtin to the scripts.
+static JanetTable *builtin_registry = NULL;
+
+static void save_builtin_registry(void) {
+    builtin_registry = janet_env_lookup(janet_env);
+    janet_gcroot(janet_wrap_table(builtin_registry));
 }
 
-static void deinit_vm(void) {
-    assert(fe_ctx != NULL);
+// Unmarshal the image that tools/mkimage compiled the builtin scripts into.
+// Returns nil if it can't be used.
+static Janet unmarshal_builtins(void) {
+    Janet image = janet_wrap_nil();
+    const uint8_t *next = builtin_image;
+    const uint8_t *end = builtin_image + builtin_image_len;
+
+    JanetTryState tstate;
+    if (!janet_try(&tstate)) {
+        // The scripts read the globals from set_vals() through refs, which
+        // are given the cartridge's values here.
+        Janet names = janet_unmarshal(next, end - next, 0, NULL, &next);
+        if (!janet_checktype(names, JANET_TUPLE))
+            janet_panic("expected a tuple of globals");
+
+        JanetTable *reg = builtin_registry;
+        const Janet *syms = janet_unwrap_tuple(names);
+        for (int32_t i = 0; i < janet_tuple_length(syms); ++i) {
+            Janet value;
+            janet_resolve(janet_env, janet_unwrap_symbol(syms[i]), &value);
+
+            JanetArray *ref = janet_array(1);
+            janet_array_push(ref, value);
+            janet_table_put(reg, syms[i], janet_wrap_array(ref));
+        }
 
-    fe_close(fe_ctx);
-    free(fe_ctx_data);
+        image = janet_unmarshal(next, end - next, 0, reg, NULL);
+        if (!janet_checktype(image, JANET_STRUCT))
+            janet_panic("expected a struct");
+    } else {
+        warnx("Couldn't load the builtin image: %s",
+            (const char *)janet_to_string(tstate.payload));
+        image = janet_wrap_nil();
+    }
+    janet_restore(&tstate);
 
-    fe_ctx = NULL;
-    fe_ctx_data = NULL;
+    janet_gcunroot(janet_wrap_table(builtin_registry));
+    builtin_registry = NULL;
+    return image;
+}
 
-    janet_deinit();
+// Run one of a builtin script's saved top-level forms. Returns false if it
+// failed, in which case the rest of the script is skipped, as it would be by
+// janet_dostring().
+static bool run_builtin_form(Janet thunk) {
+    JanetFiber *fiber = janet_fiber(janet_unwrap_function(thunk), 64, 0, NULL);
+    fiber->env = janet_env;
+
+    Janet ret;
+    JanetSignal status = janet_continue(fiber, janet_wrap_nil(), &ret);
+    if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_EVENT) {
+        janet_stacktrace(fiber, ret);
+        return false;
+    }
+    return true;
 }
 
-static uint32_t _sdl_tick(uint32_t interval, void *param) {
-    SDL_Event ev;
-    SDL_UserEvent u_ev;
+static void load_builtins(void) {
+    Janet image = unmarshal_builtins();
+    if (janet_checktype(image, JANET_NIL)) {
+        load_builtin_sources();
+        return;
+    }
+    janet_gcroot(image);
 
-    ev.type = SDL_USEREVENT;
-    u_ev.type = SDL_USEREVENT;
-    u_ev.data1 = param;
-    ev.user = u_ev;
+    const JanetKV *st = janet_unwrap_struct(image);
+    JanetTable *bindings = janet_unwrap_table(janet_struct_get(st, janet_ckeywordv("bindings")));
+    for (int32_t i = 0; i < bindings->capacity; ++i) {
+        if (!janet_checktype(bindings->data[i].key, JANET_NIL))
+            janet_table_put(janet_env, bindings->data[i].key, bindings->data[i].value);
+    }
 
-    SDL_PushEvent(&ev);
-    return interval;
+    const Janet *scripts = janet_unwrap_tuple(janet_struct_get(st, janet_ckeywordv("startup")));
+    for (int32_t i = 0; i < janet_tuple_length(scripts); ++i) {
+        const Janet *forms = janet_unwrap_tuple(janet_unwrap_tuple(scripts[i])[1]);
+        for (int32_t j = 0; j < janet_tuple_length(forms); ++j) {
+            if (!run_builtin_form(forms[j]))
+                break;
+        }
+    }
+
+    janet_gcunroot(image);
 }
 
 static bool init_sdl(void) {
@@ -265,10 +203,9 @@ static bool init_sdl(void) {
     if (texture == NULL)
         return false;
 
-    SDL_AddTimer(1000 / 30, _sdl_tick, NULL);
-    SDL_StartTextInput();
+    render_resize();
 
-    vec_init(&frames);
+    SDL_StartTextInput();
 
     return true;
 }
@@ -279,73 +216,31 @@ static void deinit_sdl(void) {
     if (window   != NULL) { SDL_DestroyWindow(window);        }
     SDL_Quit();
 
-    int i;
-    uint32_t *frame;
-    vec_foreach(&frames, frame, i) {
-        free(frame);
-    }
-
-    vec_deinit(&frames);
+    render_deinit();
 }
 
 static void draw(void) {
-    uint32_t *pixels;
-    int       pitch;
-
-    uint32_t *frame = NULL;
-    if (is_recording) {
-        frame = ecalloc(
-            config.height * FONT_HEIGHT * config.width * FONT_WIDTH,
-            sizeof(uint32_t)
-        );
+    SDL_Rect dirty;
+
+    // Damage keeps accumulating while hidden and is redrawn all at once when
+    // the window becomes visible again.
+    if (window_hidden)
+        return;
+
+    if (render(&dirty)) {
+        size_t stride = config.width * FONT_WIDTH;
+        uint32_t *pixels = &framebuffer[dirty.y * stride + dirty.x];
+        SDL_UpdateTexture(texture, &dirty, pixels, stride * sizeof(uint32_t));
+        needs_present = true;
     }
 
-    SDL_LockTexture(texture, NULL, (void *)&pixels, &pitch);
-
-    for (size_t dy = 0; dy < config.height; ++dy) {
-        for (size_t dx = 0; dx < config.width; ++dx) {
-            size_t addr = DISPLAY_START + ((dy * config.width + dx) * 2);
-            size_t ch   = (memory[bank][addr + 0]);
-            size_t fg_i = (memory[bank][addr + 1] >> 0) & 0xF;
-            size_t bg_i = (memory[bank][addr + 1] >> 4) & 0xF;
-
-            if (ch < 32 || ch > 126)
-                ch = FONT_FALLBACK_GLYPH;
-
-            size_t bg_addr = PALETTE_START + (bg_i * 4);
-            size_t bg = decode_u32_from_bytes(&memory[bank][bg_addr]);
-            bg = (bg << 8) | 0xFF; // Add alpha
+    if (!needs_present)
+        return;
 
-            size_t fg_addr = PALETTE_START + (fg_i * 4);
-            size_t fg = decode_u32_from_bytes(&memory[bank][fg_addr]);
-            fg = (fg << 8) | 0xFF; // Add alpha
-
-            size_t font = FONT_START + ((ch - 32) * FONT_WIDTH * FONT_HEIGHT);
-
-            for (size_t fy = 0; fy < FONT_HEIGHT; ++fy) {
-                for (size_t fx = 0; fx < FONT_WIDTH; ++fx) {
-                    size_t font_ch = memory[bank][font + (fy * FONT_WIDTH + fx)];
-                    size_t color = font_ch ? fg : bg;
-                    size_t addr = (((dy * FONT_HEIGHT) + fy) * (config.width * FONT_WIDTH) + ((dx * FONT_WIDTH) + fx));
-                    pixels[addr] = color;
-
-                    if (is_recording) {
-                        assert(frame != NULL);
-                        frame[addr] = color;
-                    }
-                }
-            }
-        }
-    }
-
-    SDL_UnlockTexture(texture);
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
-
-    if (is_recording) {
-        vec_push(&frames, (void *)frame);
-    }
+    needs_present = false;
 }
 
 static void reload_config(int signum) {
@@ -362,7 +257,11 @@ static void setup_signal_handlers(void) {
     sigaction(SIGHUP, &sa, NULL);
 }
 
+// The display is never made smaller than one cell, whatever size the window
+// is shrunk to.
 static void set_resolution(int width, int height, int scale) {
+    width = MAX(width, 1);
+    height = MAX(height, 1);
     config.width = width;
     config.height = height;
     config.scale = scale;
@@ -370,12 +269,29 @@ static void set_resolution(int width, int height, int scale) {
     SDL_DestroyTexture(texture);
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
                                 width * FONT_WIDTH, height * FONT_HEIGHT);
+    render_resize();
 }
 
 static void handle_window_event(SDL_Event *ev) {
-    if (ev->window.event == SDL_WINDOWEVENT_RESIZED) {
+    switch (ev->window.event) {
+    case SDL_WINDOWEVENT_RESIZED:
         set_resolution(ev->window.data1 / (FONT_WIDTH * config.scale),
                        ev->window.data2 / (FONT_HEIGHT * config.scale), config.scale);
+        break;
+    case SDL_WINDOWEVENT_HIDDEN:
+    case SDL_WINDOWEVENT_MINIMIZED:
+        window_hidden = true;
+        break;
+    case SDL_WINDOWEVENT_SHOWN:
+    case SDL_WINDOWEVENT_RESTORED:
+    case SDL_WINDOWEVENT_EXPOSED:
+        if (window_hidden)
+            sched_resume();
+        window_hidden = false;
+        needs_present = true;
+        break;
+    default:
+        break;
     }
 }
 
@@ -384,9 +300,23 @@ static void handle_keydown_event(SDL_Event *ev) {
     ssize_t kcode = ev->key.keysym.sym;
     switch (kcode) {
     case SDLK_F1:
-        has_recording = true;
-        is_recording = !is_recording;
-        log_message("recording: %s\n", is_recording ? "yes" : "no");
+        if (record_active())
+            record_stop();
+        else
+            record_start();
+        log_message("recording: %s\n", record_active() ? "yes" : "no");
+        break;
+    case SDLK_F2:
+        replay_save();
+        break;
+    case SDLK_F6:
+        rewind_resume();
+        break;
+    case SDLK_F7:
+        rewind_back();
+        break;
+    case SDLK_F8:
+        rewind_forward();
         break;
     case SDLK_ESCAPE:
         quit = true;
@@ -411,61 +341,98 @@ static void handle_keydown_event(SDL_Event *ev) {
     }
 
     if (name) {
-        call_func(callbacks[mode.cur][SC_keydown], "s", name);
+        input_key(name);
     }
 }
 
 static void handle_mousemotion_event(SDL_Event *ev) {
     double celx = (((double)ev->motion.x) / FONT_WIDTH) / config.scale;
     double cely = (((double)ev->motion.y) / FONT_HEIGHT) / config.scale;
-    call_func(callbacks[mode.cur][SC_mouse], "snnn", "motion", (double)1, celx, cely);
+    input_motion(celx, cely);
 }
 
 static void handle_mousebuttondown_event(SDL_Event *ev) {
     double celx = (((double)ev->button.x) / FONT_WIDTH) / config.scale;
     double cely = (((double)ev->button.y) / FONT_HEIGHT) / config.scale;
-    call_func(callbacks[mode.cur][SC_mouse], "snnn", mouse_button_strs[ev->button.button],
-              (double)ev->button.clicks, celx, cely);
+    input_button(mouse_button_strs[ev->button.button], ev->button.clicks, celx, cely);
 }
 
 static void handle_mousewheel_event(SDL_Event *ev) {
-    call_func(callbacks[mode.cur][SC_mouse], "snnn", "wheel",
-              (double)ev->wheel.y, 0.0, 0.0);
+    input_wheel(ev->wheel.y);
 }
 
-static void handle_userevent(SDL_Event *ev) {
-    _Bool has_delay = timerisset(&delay_val);
+void send_keydown(const char *name) {
+    call_func(callbacks[mode.cur][SC_keydown], "s", name);
+}
 
-    struct timeval cur_time;
-    struct timeval diff;
+void send_mouse(const char *button, double n, double x, double y) {
+    call_func(callbacks[mode.cur][SC_mouse], "snnn", button, n, x, y);
+}
 
-    if (has_delay) {
-        gettimeofday(&cur_time, NULL);
-        timeradd(&delay_set, &delay_val, &diff);
-    }
+// Hand a frame's worth of input to the script's `events` callback, if it has
+// one. Returns false if it doesn't, in which case the events should be sent
+// one by one.
+_Bool send_events(const struct InputEvent *events, size_t count) {
+    const char *name = callbacks[mode.cur][SC_events];
+    if (!func_exists(name))
+        return false;
 
-    if (!has_delay || timercmp(&cur_time, &diff, >)) {
-        if (has_delay) timerclear(&delay_val);
+    call_func(name, "e", events, count);
+    return true;
+}
 
-        ++mode.steps[mode.cur];
+void step(void) {
+    if (startup_ms < 0) {
+        startup_ms = (double)(SDL_GetPerformanceCounter() - startup_counter) * 1e3
+            / SDL_GetPerformanceFrequency();
+        if (config.debug)
+            log_message("startup: %.2f ms to the first step\n", startup_ms);
+    }
 
-        if (!mode.inited[mode.cur]) {
-            call_func(callbacks[mode.cur][SC_init], "");
-            mode.inited[mode.cur] = true;
-        }
+    // The builtin modes switch to the next one from their init or step, so
+    // the mode has to be read once, up front. Otherwise the next mode would
+    // be marked as inited without ever having been.
+    enum ModeType cur = mode.cur;
+    ++mode.steps[cur];
 
-        call_func(callbacks[mode.cur][SC_step], "");
-        draw();
+    if (!mode.inited[cur]) {
+        call_func(callbacks[cur][SC_init], "");
+        mode.inited[cur] = true;
     }
 
-    SDL_FlushEvent(SDL_USEREVENT);
+    // The new mode starts with the next step.
+    if (mode.cur == cur)
+        call_func(callbacks[cur][SC_step], "");
+
+    record_step();
+    rewind_step();
+}
+
+// fe ran out of memory during a step. Start it over with twice the heap, and
+// the cartridge with it, from the top. Returns false if the heap can't grow.
+bool restart_cartridge(void) {
+    if (lang != LM_Fe || !fe_heap.exhausted || !restart_fe(fe_heap.size * 2))
+        return false;
+
+    set_vals();
+    load(cartridge);
+    set_vals();
+
+    mode.cur = load_error ? MT_Error : MT_Normal;
+    mode.inited[MT_Normal] = false;
+    return true;
 }
 
 static void run(void) {
     SDL_Event ev;
 
+    // Restarting the cartridge sets its own recovery point while it loads, so
+    // this one has to be set again afterwards.
+rearm:;
     ssize_t r = setjmp(fe_error_recover);
     if (r == 1) {
+        if (restart_cartridge())
+            goto rearm;
         mode.cur = MT_Error;
     }
 
@@ -474,13 +441,24 @@ static void run(void) {
     while (!quit) {
         c_mode = mode.cur;
 
-        while (SDL_PollEvent(&ev)) {
+        // Sleep until there's input or the next step is due, then handle
+        // everything else that's queued up.
+        //
+        // While the window is hidden, no steps are run at all and we sleep
+        // until the next event, rather than stepping at full rate with nothing
+        // to show for it. The cartridge picks up where it left off once the
+        // window is shown again.
+        _Bool has_event = window_hidden
+            ? SDL_WaitEvent(&ev)
+            : SDL_WaitEventTimeout(&ev, sched_timeout());
+
+        while (has_event) {
             switch (ev.type) {
             case SDL_QUIT:
                 quit = true;
                 break;
             case SDL_TEXTINPUT:
-                call_func("keydown", "s", ev.text.text);
+                input_text(ev.text.text);
                 break;
             case SDL_KEYDOWN:
                 handle_keydown_event(&ev);
@@ -497,169 +475,120 @@ static void run(void) {
             case SDL_WINDOWEVENT:
                 handle_window_event(&ev);
                 break;
-            case SDL_USEREVENT:
-                handle_userevent(&ev);
-                break;
             default:
                 break;
             }
-        }
-
-        draw();
-    }
-}
 
-static void dump_recording(void) {
-    assert(has_recording);
-
-    int error = 0;
-
-    time_t t = time(NULL);
-    char fname[128];
-    strftime(fname, sizeof(fname), "recording-%Y%m%d-%H%M%S.gif", localtime(&t));
-
-    size_t g_width = config.width * FONT_WIDTH;
-    size_t g_height = config.height * FONT_HEIGHT;
-
-    GifFileType* g_file = EGifOpenFileName(fname, false, &error);
-    if (!g_file) goto giflib_error;
-
-    if (EGifPutScreenDesc(g_file, g_width, g_height, 8, 0, NULL) == GIF_ERROR)
-        goto giflib_error;
-
-    char nsle[12] = "NETSCAPE2.0";
-
-    char subblock[] = {
-        1,
-        0,
-        0
-    };
-
-    EGifPutExtensionLeader(g_file, APPLICATION_EXT_FUNC_CODE);
-    EGifPutExtensionBlock(g_file, ARRAY_LEN(nsle) - 1, nsle);
-    EGifPutExtensionBlock(g_file, ARRAY_LEN(subblock), subblock);
-    EGifPutExtensionTrailer(g_file);
-
-    int i;
-    uint32_t *frame;
-    vec_foreach(&frames, frame, i) {
-        size_t sz = g_width * g_height;
-
-        GifColorType colors[16] = {0};
-        size_t colors_num = 0;
-
-        GifByteType *g_frame_pixels = ecalloc(sz, sizeof(GifByteType));
-
-        for (size_t i = 0; i < sz; ++i) {
-            size_t color_index = (size_t)-1;
-
-            uint32_t cur_color = frame[i];
-            GifColorType g_cur_color = {0};
-            g_cur_color.Red   = (cur_color >> 24) & 0xFF;
-            g_cur_color.Green = (cur_color >> 16) & 0xFF;
-            g_cur_color.Blue  = (cur_color >>  8) & 0xFF;
-
-            _Bool contained = false;
-            for (size_t c = 0; c < colors_num; ++c) {
-                if (
-                    g_cur_color.Red == colors[c].Red &&
-                    g_cur_color.Green == colors[c].Green &&
-                    g_cur_color.Blue == colors[c].Blue
-                ) {
-                    contained = true;
-                    color_index = c;
-                    break;
-                }
-            }
-
-            if (!contained) {
-                assert(colors_num < ARRAY_LEN(colors));
-
-                colors[colors_num] = g_cur_color;
-                color_index = colors_num;
-                ++colors_num;
-            }
-
-            g_frame_pixels[i] = color_index;
+            has_event = SDL_PollEvent(&ev);
         }
 
-        uint8_t gce_str[] = {
-            0x04,
-            0x00,
-            0x00,
-            0x03,
-        };
-
-        if (EGifPutExtension(
-            g_file,
-            GRAPHICS_EXT_FUNC_CODE,
-            ARRAY_LEN(gce_str),
-            gce_str
-        ) == GIF_ERROR)
-            goto giflib_error;
-
-        if (EGifPutImageDesc(
-            g_file,
-            0, 0, g_width, g_height,
-            false,
-            GifMakeMapObject(ARRAY_LEN(colors), colors)
-        ) == GIF_ERROR) goto giflib_error;
-
-        for (size_t rowptr = 0; rowptr < sz; rowptr += g_width) {
-            if (EGifPutLine(
-                g_file, &g_frame_pixels[rowptr], g_width
-            ) == GIF_ERROR) goto giflib_error;
+        // Input is only handed over once per frame, right before the step,
+        // however much of it arrived in between.
+        //
+        // If we fell behind, catch up on the missed steps but only draw once
+        // at the end.
+        size_t due = sched_due();
+        if (rewind_paused() || window_hidden)
+            due = 0;
+        if (due > 0)
+            input_flush();
+        for (size_t i = 0; i < due && !quit && !sched_holding(); ++i) {
+            step();
         }
-    }
-
-    EGifCloseFile(g_file, &error);
-    log_message("Saved %s\n", fname);
 
-    return;
+        draw();
+    }
+}
 
-giflib_error:
-    warnx("couldn't save recording to '%s': error %d: %s",
-        fname, error, GifErrorString(error));
+static _Noreturn void usage(int status) {
+    printf("usage: %s [-dr] [file]\n", argv0);
+    printf("       %s -H ticks [-c] [-s seed] [-i input] [-o output] [-b stats] [file]\n", argv0);
+    printf("       %s [-V]\n", argv0);
+    printf("       %s [-h]\n", argv0);
+    exit(status);
 }
 
 int main(int argc, char **argv) {
+    startup_counter = SDL_GetPerformanceCounter();
+
+    unsigned int seed = time(NULL);
+    _Bool recording = false;
+
     ARGBEGIN {
     break; case 'd':
         config.debug = !config.debug;
     break; case 'r':
-        is_recording = true;
-        has_recording = true;
+        recording = true;
+    break; case 'H':
+        headless.ticks = strtoul(EARGF(usage(1)), NULL, 0);
+        if (headless.ticks == 0) usage(1);
+    break; case 'c':
+        headless.cells_only = true;
+    break; case 'i':
+        headless.input = EARGF(usage(1));
+    break; case 'o':
+        headless.output = EARGF(usage(1));
+    break; case 'b':
+        headless.bench = EARGF(usage(1));
+    break; case 's':
+        seed = strtoul(EARGF(usage(1)), NULL, 0);
     break; case 'v': case 'V':
         printf("cel7ce v"VERSION"\n");
         return 0;
-    break; case 'h': default:
-        printf("usage: %s [-d] [file]\n", argv[0]);
-        printf("       %s [-V]\n", argv[0]);
-        printf("       %s [-h]\n", argv[0]);
-        return 0;
+    break; case 'h':
+        usage(0);
+    break; default:
+        usage(1);
     } ARGEND
 
-    srand(time(NULL));
+    rng_seed(seed);
+    headless.cartridge = *argv;
 
     setup_signal_handlers();
 
     init_mem();
     init_vm();
     set_vals();
-    load(*argv);
+    save_builtin_registry();
+    cartridge = *argv;
+    load(cartridge);
     set_vals();
     load_builtins();
 
-    bool sdl_error = !init_sdl();
-    if (sdl_error) errx(1, "SDL error: %s\n", SDL_GetError());
+    if (recording)
+        record_start();
+
+    int status = 0;
+
+    if (headless.ticks > 0) {
+        render_resize();
+        status = run_headless();
+    } else {
+        bool sdl_error = !init_sdl();
+        if (sdl_error) errx(1, "SDL error: %s\n", SDL_GetError());
 
-    run();
+        sched_init(config.fps);
+        replay_init(config.replay, config.fps);
+        rewind_init();
+        run();
+    }
+
+    if (config.debug) {
+        log_message("steps: %zu, late: %zu, dropped: %zu\n",
+            sched.steps, sched.late, sched.dropped);
+        if (lang == LM_Fe) {
+            log_message("fe heap: %zu bytes, collections: %zu, restarts: %zu\n",
+                fe_heap.size, fe_heap.collections, fe_heap.restarts);
+        }
+    }
 
-    if (has_recording) dump_recording();
+    record_stop();
+    replay_deinit();
+    rewind_deinit();
 
     deinit_vm();
     deinit_sdl();
     deinit_mem();
 
-    return 0;
+    return status;
 }
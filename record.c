@@ -0,0 +1,513 @@
+#include <gif_lib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cel7ce.h"
+
+// GIF recording and instant replay. Both work on captured display states
+// (see capture_state()) rather than pixels, and only rasterize them when
+// writing the GIF, on a worker thread.
+//
+// Recording copies each state into a small fixed queue for the encoder; if
+// the encoder falls behind, new states are dropped rather than making the
+// caller wait or the queue grow.
+//
+// Replay keeps the last config.replay seconds of states in a delta-coded
+// ring (see ring.c), and writes them out on request.
+
+// A slot holds one captured state, CAPTURE_SIZE (about 16 KiB) no matter
+// the display's size. The queue used to hold 8 full RGBA frames, 74 KiB
+// each at the default 24x16 and more for larger displays. 32 states cost
+// less than those did, and give the encoder about a second of slack at 30
+// fps before anything is dropped.
+#define RECORD_QUEUE_LEN 32
+#define REPLAY_BYTES     (8 * 1024 * 1024)
+
+// Every colour table (the global one, and local ones for frames drawn after
+// a palette change) holds the 16 palette colours followed by a transparent
+// entry, which frames use for pixels that haven't changed.
+#define GIF_COLORS      32
+#define GIF_TRANSPARENT 16
+
+// Most viewers stretch delays shorter than this (in hundredths of a second)
+// to something much longer, so states captured closer together are held back
+// and folded into the next frame.
+#define GIF_MIN_DELAY   2
+
+struct GifWriter {
+    const char *prefix;
+    GifFileType *gif;
+    char fname[128];
+    size_t width, height;
+    _Bool failed;
+
+    uint32_t global[16];       // Palette in the global colour table
+    GifByteType *indices;      // The state being added
+    GifByteType *screen;       // What's shown once the pending frame is
+    uint32_t shown[16];        // ... and in which colours
+    _Bool screen_valid;
+
+    // A frame's delay isn't known until the next one comes along, so the
+    // latest frame is held back until then.
+    _Bool pending;
+    uint32_t pending_time;
+    size_t px, py, pw, ph;
+    _Bool pending_local;       // Needs a local colour table
+    uint32_t pending_colors[16];
+    GifByteType *pending_pixels;
+    int last_delay;
+
+    // The latest state that came too soon after the pending frame.
+    uint8_t *held;
+    _Bool has_held;
+};
+
+struct Recording {
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *cond;
+
+    // Protected by lock.
+    uint8_t *queue;
+    size_t head, count;
+    _Bool stopping;
+
+    size_t frames, dropped;
+
+    // Only touched by the worker.
+    struct GifWriter writer;
+};
+
+struct Replay {
+    struct Ring ring;
+
+    // A copy of the ring that's being written out, and the thread doing so.
+    struct Ring saving;
+    SDL_Thread *thread;
+    SDL_atomic_t busy;
+};
+
+static struct Recording rec = {0};
+static struct Replay replay = {0};
+
+static uint8_t capture[CAPTURE_SIZE];
+
+static void gif_error(struct GifWriter *w) {
+    int error = w->gif != NULL ? w->gif->Error : 0;
+    warnx("couldn't save recording to '%s': error %d: %s",
+        w->fname, error, GifErrorString(error));
+    w->failed = true;
+}
+
+static void read_palette(const uint8_t *state, uint32_t *colors) {
+    for (size_t i = 0; i < 16; ++i) {
+        uint8_t *bytes = (uint8_t *)&state[CAPTURE_ADDR(PALETTE_START + (i * 4))];
+        colors[i] = decode_u32_from_bytes(bytes) & 0xFFFFFF;
+    }
+}
+
+static ColorMapObject *make_map(const uint32_t *colors) {
+    GifColorType map[GIF_COLORS] = {0};
+    for (size_t i = 0; i < 16; ++i) {
+        map[i].Red   = (colors[i] >> 16) & 0xFF;
+        map[i].Green = (colors[i] >>  8) & 0xFF;
+        map[i].Blue  = (colors[i] >>  0) & 0xFF;
+    }
+    return GifMakeMapObject(GIF_COLORS, map);
+}
+
+// Write out the pending frame, now that we know how long it's shown for.
+static void gif_flush(struct GifWriter *w, int delay) {
+    if (!w->pending || w->failed)
+        return;
+    w->pending = false;
+    w->last_delay = delay;
+
+    GraphicsControlBlock gcb = {
+        .DisposalMode = DISPOSE_DO_NOT,
+        .UserInputFlag = false,
+        .DelayTime = delay,
+        .TransparentColor = GIF_TRANSPARENT,
+    };
+    GifByteType gce[4];
+    EGifGCBToExtension(&gcb, gce);
+
+    if (EGifPutExtension(w->gif, GRAPHICS_EXT_FUNC_CODE, ARRAY_LEN(gce), gce) == GIF_ERROR) {
+        gif_error(w);
+        return;
+    }
+
+    ColorMapObject *map = w->pending_local ? make_map(w->pending_colors) : NULL;
+    int res = EGifPutImageDesc(w->gif, w->px, w->py, w->pw, w->ph, false, map);
+    if (map != NULL)
+        GifFreeMapObject(map);
+
+    if (res == GIF_ERROR) {
+        gif_error(w);
+        return;
+    }
+
+    for (size_t row = 0; row < w->ph; ++row) {
+        if (EGifPutLine(w->gif, &w->pending_pixels[row * w->pw], w->pw) == GIF_ERROR) {
+            gif_error(w);
+            return;
+        }
+    }
+}
+
+static void gif_add(struct GifWriter *w, const uint8_t *state, uint32_t now);
+
+static void gif_close(struct GifWriter *w) {
+    if (w->has_held)
+        gif_add(w, w->held, w->pending_time + GIF_MIN_DELAY * 10);
+
+    // There's nothing after the last frame to time it by, so it gets the
+    // same delay as the one before.
+    gif_flush(w, w->last_delay);
+
+    free(w->indices);
+    free(w->screen);
+    free(w->pending_pixels);
+    free(w->held);
+    w->indices = w->screen = w->pending_pixels = NULL;
+    w->held = NULL;
+
+    if (w->gif == NULL)
+        return;
+
+    int error = 0;
+    if (EGifCloseFile(w->gif, &error) == GIF_ERROR) {
+        warnx("couldn't save recording to '%s': error %d: %s",
+            w->fname, error, GifErrorString(error));
+    } else if (!w->failed) {
+        log_message("Saved %s\n", w->fname);
+    }
+
+    w->gif = NULL;
+}
+
+// Start a new file, with the palette of the given state as its global
+// colour table.
+static void gif_open(struct GifWriter *w, const uint8_t *state) {
+    int error = 0;
+
+    char stamp[64];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+    snprintf(w->fname, sizeof(w->fname), "%s-%s.gif", w->prefix, stamp);
+
+    // Don't clobber an earlier recording from the same second.
+    for (size_t n = 1; n < 100; ++n) {
+        FILE *fp = fopen(w->fname, "r");
+        if (fp == NULL)
+            break;
+        fclose(fp);
+        snprintf(w->fname, sizeof(w->fname), "%s-%s-%zu.gif", w->prefix, stamp, n);
+    }
+
+    capture_size(state, &w->width, &w->height);
+    read_palette(state, w->global);
+
+    w->failed = false;
+    w->pending = false;
+    w->screen_valid = false;
+    w->has_held = false;
+    w->last_delay = GIF_MIN_DELAY;
+    w->indices = ecalloc(w->width * w->height, sizeof(GifByteType));
+    w->screen = ecalloc(w->width * w->height, sizeof(GifByteType));
+    w->pending_pixels = ecalloc(w->width * w->height, sizeof(GifByteType));
+    w->held = ecalloc(CAPTURE_SIZE, sizeof(uint8_t));
+
+    w->gif = EGifOpenFileName(w->fname, false, &error);
+    if (w->gif == NULL) {
+        warnx("couldn't save recording to '%s': error %d: %s",
+            w->fname, error, GifErrorString(error));
+        w->failed = true;
+        return;
+    }
+
+    // Needed for the graphics control extensions; giflib only works this out
+    // by itself when writing a whole file at once.
+    EGifSetGifVersion(w->gif, true);
+
+    ColorMapObject *map = make_map(w->global);
+    int res = EGifPutScreenDesc(w->gif, w->width, w->height, 8, 0, map);
+    GifFreeMapObject(map);
+
+    if (res == GIF_ERROR) {
+        gif_error(w);
+        return;
+    }
+
+    char nsle[12] = "NETSCAPE2.0";
+    char subblock[] = { 1, 0, 0 };
+
+    EGifPutExtensionLeader(w->gif, APPLICATION_EXT_FUNC_CODE);
+    EGifPutExtensionBlock(w->gif, ARRAY_LEN(nsle) - 1, nsle);
+    EGifPutExtensionBlock(w->gif, ARRAY_LEN(subblock), subblock);
+    EGifPutExtensionTrailer(w->gif);
+}
+
+// Add a captured state. Only the bounding box of the pixels that changed
+// since the last frame is written, with the unchanged pixels inside it left
+// transparent; states that change nothing just extend the previous frame.
+static void gif_add(struct GifWriter *w, const uint8_t *state, uint32_t now) {
+    size_t width = w->width, height = w->height;
+    w->has_held = false;
+
+    uint32_t colors[16];
+    read_palette(state, colors);
+    rasterize_capture(state, w->indices);
+
+    _Bool same_colors = !memcmp(colors, w->shown, sizeof(colors));
+    size_t x0 = width, y0 = height, x1 = 0, y1 = 0;
+
+    for (size_t y = 0; y < height; ++y) {
+        const GifByteType *cur  = &w->indices[y * width];
+        const GifByteType *prev = &w->screen[y * width];
+
+        if (w->screen_valid && same_colors && !memcmp(cur, prev, width))
+            continue;
+
+        for (size_t x = 0; x < width; ++x) {
+            if (w->screen_valid && colors[cur[x]] == w->shown[prev[x]])
+                continue;
+            x0 = MIN(x0, x); x1 = MAX(x1, x + 1);
+            y0 = MIN(y0, y); y1 = MAX(y1, y + 1);
+        }
+    }
+
+    if (x0 >= x1)
+        return;
+
+    gif_flush(w, MIN((now / 10) - (w->pending_time / 10), 0xFFFF));
+    if (w->failed)
+        return;
+
+    w->px = x0; w->pw = x1 - x0;
+    w->py = y0; w->ph = y1 - y0;
+    w->pending_local = !!memcmp(colors, w->global, sizeof(colors));
+    memcpy(w->pending_colors, colors, sizeof(colors));
+
+    GifByteType *dst = w->pending_pixels;
+    for (size_t y = y0; y < y1; ++y) {
+        const GifByteType *cur  = &w->indices[y * width];
+        const GifByteType *prev = &w->screen[y * width];
+
+        for (size_t x = x0; x < x1; ++x) {
+            _Bool same = w->screen_valid && colors[cur[x]] == w->shown[prev[x]];
+            *dst++ = same ? GIF_TRANSPARENT : cur[x];
+        }
+    }
+
+    memcpy(w->screen, w->indices, width * height);
+    memcpy(w->shown, colors, sizeof(colors));
+    w->screen_valid = true;
+    w->pending = true;
+    w->pending_time = now;
+}
+
+static void gif_put_frame(struct GifWriter *w, const uint8_t *state) {
+    size_t width, height;
+    capture_size(state, &width, &height);
+
+    if (w->indices == NULL || width != w->width || height != w->height) {
+        // GIFs can't change size, so a resize starts a new file.
+        gif_close(w);
+        gif_open(w, state);
+    }
+
+    if (w->failed)
+        return;
+
+    uint32_t now = capture_time(state);
+    if (w->pending && now - w->pending_time < GIF_MIN_DELAY * 10) {
+        memcpy(w->held, state, CAPTURE_SIZE);
+        w->has_held = true;
+        return;
+    }
+
+    gif_add(w, state, now);
+}
+
+static int record_worker(void *data) {
+    UNUSED(data);
+
+    while (true) {
+        SDL_LockMutex(rec.lock);
+        while (rec.count == 0 && !rec.stopping)
+            SDL_CondWait(rec.cond, rec.lock);
+        if (rec.count == 0) {
+            SDL_UnlockMutex(rec.lock);
+            break;
+        }
+        uint8_t *state = &rec.queue[rec.head * CAPTURE_SIZE];
+        SDL_UnlockMutex(rec.lock);
+
+        // The slot stays counted (and so off-limits to record_frame) until
+        // it's been encoded.
+        gif_put_frame(&rec.writer, state);
+
+        SDL_LockMutex(rec.lock);
+        rec.head = (rec.head + 1) % RECORD_QUEUE_LEN;
+        --rec.count;
+        SDL_UnlockMutex(rec.lock);
+    }
+
+    gif_close(&rec.writer);
+    return 0;
+}
+
+_Bool record_active(void) {
+    return rec.thread != NULL;
+}
+
+void record_start(void) {
+    if (record_active())
+        return;
+
+    rec.head = rec.count = 0;
+    rec.frames = rec.dropped = 0;
+    rec.stopping = false;
+    rec.writer.prefix = "recording";
+    rec.queue = ecalloc(RECORD_QUEUE_LEN, CAPTURE_SIZE);
+
+    rec.lock = SDL_CreateMutex();
+    rec.cond = SDL_CreateCond();
+    rec.thread = SDL_CreateThread(record_worker, "record", NULL);
+
+    if (rec.lock == NULL || rec.cond == NULL || rec.thread == NULL) {
+        warnx("couldn't start recording: %s", SDL_GetError());
+        rec.thread = NULL;
+    }
+}
+
+// Queue a copy of a captured state for encoding. Never waits for the encoder.
+void record_frame(const uint8_t *state) {
+    if (!record_active())
+        return;
+
+    SDL_LockMutex(rec.lock);
+    _Bool full = rec.count == RECORD_QUEUE_LEN;
+    size_t slot = (rec.head + rec.count) % RECORD_QUEUE_LEN;
+    if (full)
+        ++rec.dropped;
+    SDL_UnlockMutex(rec.lock);
+
+    if (full)
+        return;
+
+    // The worker won't touch this slot until it's been counted.
+    memcpy(&rec.queue[slot * CAPTURE_SIZE], state, CAPTURE_SIZE);
+
+    SDL_LockMutex(rec.lock);
+    ++rec.count;
+    ++rec.frames;
+    SDL_CondSignal(rec.cond);
+    SDL_UnlockMutex(rec.lock);
+}
+
+// Finish encoding whatever is queued and close the file.
+void record_stop(void) {
+    if (!record_active())
+        return;
+
+    SDL_LockMutex(rec.lock);
+    rec.stopping = true;
+    SDL_CondSignal(rec.cond);
+    SDL_UnlockMutex(rec.lock);
+
+    SDL_WaitThread(rec.thread, NULL);
+    SDL_DestroyCond(rec.cond);
+    SDL_DestroyMutex(rec.lock);
+    rec.thread = NULL;
+
+    if (rec.dropped > 0) {
+        log_message("recording: dropped %zu of %zu frames\n",
+            rec.dropped, rec.frames + rec.dropped);
+    }
+
+    free(rec.queue);
+    rec.queue = NULL;
+}
+
+_Bool replay_active(void) {
+    return replay.ring.buf != NULL;
+}
+
+// Start keeping the last `seconds` of steps, at `fps` steps per second.
+void replay_init(double seconds, double fps) {
+    if (seconds <= 0 || replay_active())
+        return;
+
+    ring_init(&replay.ring, REPLAY_BYTES, CAPTURE_SIZE, (size_t)(seconds * fps));
+}
+
+static int replay_worker(void *data) {
+    UNUSED(data);
+
+    struct GifWriter writer = { .prefix = "replay" };
+    struct RingIter it;
+    uint8_t *state = ecalloc(CAPTURE_SIZE, sizeof(uint8_t));
+
+    ring_iter_start(&replay.saving, &it, state);
+    while (ring_iter_next(&it))
+        gif_put_frame(&writer, state);
+    gif_close(&writer);
+
+    free(state);
+    ring_deinit(&replay.saving);
+    SDL_AtomicSet(&replay.busy, 0);
+    return 0;
+}
+
+// Write out the replay buffer in the background. The game carries on
+// filling the buffer in the meantime; what's saved is what was there when
+// this was called.
+void replay_save(void) {
+    if (!replay_active() || replay.ring.frames == 0)
+        return;
+
+    if (SDL_AtomicGet(&replay.busy)) {
+        log_message("replay: still saving the last one\n");
+        return;
+    }
+
+    if (replay.thread != NULL)
+        SDL_WaitThread(replay.thread, NULL);
+
+    ring_copy(&replay.saving, &replay.ring);
+    SDL_AtomicSet(&replay.busy, 1);
+
+    replay.thread = SDL_CreateThread(replay_worker, "replay", NULL);
+    if (replay.thread == NULL) {
+        warnx("couldn't save replay: %s", SDL_GetError());
+        ring_deinit(&replay.saving);
+        SDL_AtomicSet(&replay.busy, 0);
+    }
+}
+
+void replay_deinit(void) {
+    if (replay.thread != NULL)
+        SDL_WaitThread(replay.thread, NULL);
+    replay.thread = NULL;
+
+    if (replay_active())
+        ring_deinit(&replay.ring);
+}
+
+// Capture the display after a step, for whichever of recording and replay
+// are running.
+void record_step(void) {
+    if (!record_active() && !replay_active())
+        return;
+
+    capture_state(capture);
+    record_frame(capture);
+    if (replay_active())
+        ring_push(&replay.ring, capture);
+}
@@ -0,0 +1,427 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+
+// The rasterized display, config.width * FONT_WIDTH pixels per row. It's
+// kept around between frames so that only damaged cells need to be redrawn.
+uint32_t *framebuffer = NULL;
+
+// One flag per display cell, set by the memory write paths and cleared once
+// the cell has been rasterized.
+static uint8_t dirty_cells[DISPLAY_CELLS];
+static _Bool dirty_any = true;
+static _Bool dirty_all = true;
+
+// Ready-made RGBA tiles for every (glyph, attribute byte) pair, built on
+// first use. Palette and font writes only mark the affected glyphs and colours
+// as stale; the matching tiles (and the cells that use them) are invalidated
+// by the next render(), so poking a glyph byte-by-byte stays cheap.
+#define GLYPH_COUNT 96
+#define TILE_SIZE   (FONT_WIDTH * FONT_HEIGHT)
+
+static uint32_t (*tiles)[256][TILE_SIZE] = NULL;
+static uint8_t tile_valid[GLYPH_COUNT][256];
+
+// Packed copy of each bank's font: a byte per glyph row, with bit x set if
+// pixel x is. Tiles are built from this rather than from the byte-per-pixel
+// font in memory, which scripts still see. mark_dirty() keeps it in sync, so
+// every write to memory needs to go through there.
+static uint8_t font_bits[BANKS_MAX][GLYPH_COUNT][FONT_HEIGHT];
+
+static uint8_t stale_glyphs[GLYPH_COUNT];
+static uint8_t stale_colors[16];
+static _Bool stale_any = false;
+
+// Large redraws are split into bands of cell rows and copied out by a pool of
+// worker threads, with the calling thread joining in. Tiles are all built
+// beforehand, so the workers only read shared state and each writes its own
+// rows of the framebuffer; the result is the same as drawing serially.
+//
+// Each thread is handed a contiguous range of rows. Once it runs out, it
+// steals rows from the others' ranges.
+#define MAX_WORKERS        8
+#define PARALLEL_MIN_CELLS 512
+
+struct Band {
+    SDL_atomic_t next;
+    int end;
+};
+
+static struct {
+    _Bool inited;
+    size_t count;
+    SDL_Thread *threads[MAX_WORKERS];
+    SDL_sem *start, *done;
+    _Bool stopping;
+    struct Band bands[MAX_WORKERS + 1];
+} pool = {0};
+
+void mark_all_dirty(void) {
+    memset(tile_valid, 0x0, sizeof(tile_valid));
+    memset(stale_glyphs, 0x0, sizeof(stale_glyphs));
+    memset(stale_colors, 0x0, sizeof(stale_colors));
+    stale_any = false;
+
+    dirty_all = true;
+    dirty_any = true;
+}
+
+static void update_font_bits(size_t bk, size_t start, size_t end) {
+    for (size_t a = start; a < end; ++a) {
+        size_t off = a - FONT_START;
+        uint8_t *row = &font_bits[bk][off / TILE_SIZE][(off % TILE_SIZE) / FONT_WIDTH];
+        uint8_t bit = 1 << (off % FONT_WIDTH);
+
+        if (memory[bk][a])
+            *row |= bit;
+        else
+            *row &= ~bit;
+    }
+}
+
+void mark_dirty(size_t bk, size_t addr, size_t sz) {
+    if (sz == 0)
+        return;
+
+    size_t end = addr + sz;
+
+    if (addr < DISPLAY_START && end > FONT_START)
+        update_font_bits(bk, MAX(addr, FONT_START), MIN(end, DISPLAY_START));
+
+    // Otherwise, writes to a bank that isn't being displayed don't matter;
+    // switching to it later marks everything as dirty anyway.
+    if (bk != bank)
+        return;
+
+    if (addr < FONT_START && end > PALETTE_START) {
+        size_t first = (MAX(addr, PALETTE_START) - PALETTE_START) / 4;
+        size_t last  = (MIN(end, FONT_START) - 1 - PALETTE_START) / 4;
+        memset(&stale_colors[first], 1, last - first + 1);
+        stale_any = true;
+    }
+
+    if (addr < DISPLAY_START && end > FONT_START) {
+        size_t first = (MAX(addr, FONT_START) - FONT_START) / TILE_SIZE;
+        size_t last  = (MIN(end, DISPLAY_START) - 1 - FONT_START) / TILE_SIZE;
+        memset(&stale_glyphs[first], 1, last - first + 1);
+        stale_any = true;
+    }
+
+    if (end > DISPLAY_START) {
+        size_t first = (MAX(addr, DISPLAY_START) - DISPLAY_START) / 2;
+        size_t last  = (end - 1 - DISPLAY_START) / 2;
+        if (last >= DISPLAY_CELLS)
+            last = DISPLAY_CELLS - 1;
+        if (first > last)
+            return;
+
+        memset(&dirty_cells[first], 1, last - first + 1);
+        dirty_any = true;
+    }
+}
+
+void render_resize(void) {
+    blend_init();
+
+    free(framebuffer);
+    framebuffer = ecalloc(
+        config.height * FONT_HEIGHT * config.width * FONT_WIDTH,
+        sizeof(uint32_t)
+    );
+    mark_all_dirty();
+}
+
+static void pool_deinit(void);
+
+void render_deinit(void) {
+    pool_deinit();
+    free(framebuffer);
+    free(tiles);
+    framebuffer = NULL;
+    tiles = NULL;
+}
+
+static size_t cell_glyph(size_t ch) {
+    if (ch < 32 || ch > 126)
+        ch = FONT_FALLBACK_GLYPH;
+    return ch - 32;
+}
+
+static void build_tile(uint32_t *tile, size_t glyph, size_t attr) {
+    size_t fg_i = (attr >> 0) & 0xF;
+    size_t bg_i = (attr >> 4) & 0xF;
+
+    size_t bg_addr = PALETTE_START + (bg_i * 4);
+    uint32_t bg = decode_u32_from_bytes(&memory[bank][bg_addr]);
+    bg = (bg << 8) | 0xFF; // Add alpha
+
+    size_t fg_addr = PALETTE_START + (fg_i * 4);
+    uint32_t fg = decode_u32_from_bytes(&memory[bank][fg_addr]);
+    fg = (fg << 8) | 0xFF; // Add alpha
+
+    expand_glyph32(tile, font_bits[bank][glyph], fg, bg);
+}
+
+static void prepare_tile(size_t cell) {
+    size_t addr  = DISPLAY_START + (cell * 2);
+    size_t glyph = cell_glyph(memory[bank][addr + 0]);
+    size_t attr  = memory[bank][addr + 1];
+
+    if (!tile_valid[glyph][attr]) {
+        build_tile(tiles[glyph][attr], glyph, attr);
+        tile_valid[glyph][attr] = true;
+    }
+}
+
+// Copy a cell's (already built) tile into the framebuffer.
+static void rasterize_cell(size_t dx, size_t dy) {
+    size_t addr  = DISPLAY_START + ((dy * config.width + dx) * 2);
+    size_t glyph = cell_glyph(memory[bank][addr + 0]);
+    size_t attr  = memory[bank][addr + 1];
+
+    const uint32_t *tile = tiles[glyph][attr];
+    size_t stride = config.width * FONT_WIDTH;
+    uint32_t *dst = &framebuffer[(dy * FONT_HEIGHT) * stride + (dx * FONT_WIDTH)];
+
+    for (size_t fy = 0; fy < FONT_HEIGHT; ++fy, dst += stride, tile += FONT_WIDTH)
+        memcpy(dst, tile, FONT_WIDTH * sizeof(uint32_t));
+}
+
+// Drop the tiles built from stale glyphs/colours, and mark every cell that
+// displays one of them as dirty.
+static void invalidate_stale(void) {
+    for (size_t g = 0; g < GLYPH_COUNT; ++g) {
+        if (stale_glyphs[g])
+            memset(tile_valid[g], 0x0, sizeof(tile_valid[g]));
+    }
+
+    for (size_t attr = 0; attr < 256; ++attr) {
+        if (!stale_colors[attr & 0xF] && !stale_colors[attr >> 4])
+            continue;
+        for (size_t g = 0; g < GLYPH_COUNT; ++g)
+            tile_valid[g][attr] = false;
+    }
+
+    size_t cells = MIN(config.width * config.height, DISPLAY_CELLS);
+    for (size_t cell = 0; cell < cells; ++cell) {
+        size_t addr  = DISPLAY_START + (cell * 2);
+        size_t glyph = cell_glyph(memory[bank][addr + 0]);
+        size_t attr  = memory[bank][addr + 1];
+
+        if (stale_glyphs[glyph] || stale_colors[attr & 0xF] || stale_colors[attr >> 4]) {
+            dirty_cells[cell] = true;
+            dirty_any = true;
+        }
+    }
+
+    memset(stale_glyphs, 0x0, sizeof(stale_glyphs));
+    memset(stale_colors, 0x0, sizeof(stale_colors));
+    stale_any = false;
+}
+
+static void rasterize_row(size_t dy) {
+    for (size_t dx = 0; dx < config.width; ++dx) {
+        size_t cell = dy * config.width + dx;
+        if (cell >= DISPLAY_CELLS)
+            break;
+        if (dirty_all || dirty_cells[cell])
+            rasterize_cell(dx, dy);
+    }
+}
+
+// Work through our own band of rows, then help out with everyone else's.
+static void run_bands(size_t self) {
+    for (size_t i = 0; i <= pool.count; ++i) {
+        struct Band *band = &pool.bands[(self + i) % (pool.count + 1)];
+        int row;
+        while ((row = SDL_AtomicAdd(&band->next, 1)) < band->end)
+            rasterize_row(row);
+    }
+}
+
+static int pool_worker(void *data) {
+    size_t self = (size_t)data;
+
+    while (true) {
+        SDL_SemWait(pool.start);
+        if (pool.stopping)
+            break;
+        run_bands(self);
+        SDL_SemPost(pool.done);
+    }
+
+    return 0;
+}
+
+static void pool_init(void) {
+    pool.inited = true;
+
+    int cpus = SDL_GetCPUCount();
+    size_t count = cpus > 1 ? MIN((size_t)cpus - 1, MAX_WORKERS) : 0;
+    if (count == 0)
+        return;
+
+    pool.start = SDL_CreateSemaphore(0);
+    pool.done  = SDL_CreateSemaphore(0);
+    if (pool.start == NULL || pool.done == NULL)
+        return;
+
+    for (; pool.count < count; ++pool.count) {
+        size_t self = pool.count + 1;
+        SDL_Thread *t = SDL_CreateThread(pool_worker, "render", (void *)self);
+        if (t == NULL)
+            break;
+        pool.threads[pool.count] = t;
+    }
+}
+
+static void pool_deinit(void) {
+    pool.stopping = true;
+    for (size_t i = 0; i < pool.count; ++i)
+        SDL_SemPost(pool.start);
+    for (size_t i = 0; i < pool.count; ++i)
+        SDL_WaitThread(pool.threads[i], NULL);
+
+    if (pool.start != NULL) SDL_DestroySemaphore(pool.start);
+    if (pool.done  != NULL) SDL_DestroySemaphore(pool.done);
+
+    memset(&pool, 0x0, sizeof(pool));
+}
+
+// Rasterize rows y0 to y1 (exclusive), splitting them evenly between the
+// calling thread and the workers.
+static void rasterize_rows_parallel(size_t y0, size_t y1) {
+    size_t threads = pool.count + 1;
+    size_t rows = y1 - y0;
+
+    for (size_t i = 0; i < threads; ++i) {
+        SDL_AtomicSet(&pool.bands[i].next, y0 + rows * i / threads);
+        pool.bands[i].end = y0 + rows * (i + 1) / threads;
+    }
+
+    for (size_t i = 0; i < pool.count; ++i)
+        SDL_SemPost(pool.start);
+    run_bands(0);
+    for (size_t i = 0; i < pool.count; ++i)
+        SDL_SemWait(pool.done);
+}
+
+// Rasterize every dirty cell into the framebuffer. Returns false if nothing
+// changed since the last call; otherwise, *rect is set to the (pixel) bounding
+// box of the cells that were redrawn.
+_Bool render(SDL_Rect *rect) {
+    if (tiles == NULL)
+        tiles = ecalloc(GLYPH_COUNT, sizeof(*tiles));
+
+    if (stale_any)
+        invalidate_stale();
+
+    if (!dirty_any)
+        return false;
+
+    // Build any missing tiles and find the damaged area up front, so that
+    // the copying can be done in parallel.
+    size_t x0 = config.width, y0 = config.height, x1 = 0, y1 = 0;
+    size_t count = 0;
+
+    for (size_t dy = 0; dy < config.height; ++dy) {
+        for (size_t dx = 0; dx < config.width; ++dx) {
+            size_t cell = dy * config.width + dx;
+            if (cell >= DISPLAY_CELLS)
+                break;
+            if (!dirty_all && !dirty_cells[cell])
+                continue;
+
+            prepare_tile(cell);
+            ++count;
+
+            x0 = MIN(x0, dx); x1 = MAX(x1, dx + 1);
+            y0 = MIN(y0, dy); y1 = MAX(y1, dy + 1);
+        }
+    }
+
+    if (count >= PARALLEL_MIN_CELLS && !pool.inited)
+        pool_init();
+
+    if (count >= PARALLEL_MIN_CELLS && pool.count > 0 && y1 - y0 > 1) {
+        rasterize_rows_parallel(y0, y1);
+    } else {
+        for (size_t dy = y0; dy < y1; ++dy)
+            rasterize_row(dy);
+    }
+
+    memset(dirty_cells, 0x0, sizeof(dirty_cells));
+    dirty_any = dirty_all = false;
+
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+
+    rect->x = x0 * FONT_WIDTH;
+    rect->y = y0 * FONT_HEIGHT;
+    rect->w = (x1 - x0) * FONT_WIDTH;
+    rect->h = (y1 - y0) * FONT_HEIGHT;
+    return true;
+}
+
+// Save what's needed to redraw the display later: its size in cells, the
+// current time, then the palette, font and cells of the current bank. state
+// must be CAPTURE_SIZE bytes.
+void capture_state(uint8_t *state) {
+    uint64_t now = sched_now();
+    uint32_t ms = (now / sched.freq) * 1000 + (now % sched.freq) * 1000 / sched.freq;
+
+    state[0] = config.width & 0xFF;
+    state[1] = (config.width >> 8) & 0xFF;
+    state[2] = config.height & 0xFF;
+    state[3] = (config.height >> 8) & 0xFF;
+    for (size_t b = 0; b < 4; ++b)
+        state[4 + b] = (ms >> (b * 8)) & 0xFF;
+    memcpy(&state[CAPTURE_HEADER], &memory[bank][PALETTE_START], MEMORY_SIZE - PALETTE_START);
+}
+
+void capture_size(const uint8_t *state, size_t *width, size_t *height) {
+    *width  = (state[0] | (state[1] << 8)) * FONT_WIDTH;
+    *height = (state[2] | (state[3] << 8)) * FONT_HEIGHT;
+}
+
+// Milliseconds on the scheduler's clock when the state was captured. Only
+// differences between captures are meaningful, and they wrap.
+uint32_t capture_time(const uint8_t *state) {
+    return decode_u32_from_bytes((uint8_t *)&state[4]);
+}
+
+// Rasterize a captured state into one palette index per pixel. Unlike
+// render(), this doesn't touch the machine or the tile cache, so it's safe to
+// call from another thread.
+void rasterize_capture(const uint8_t *state, uint8_t *indices) {
+    size_t width, height;
+    capture_size(state, &width, &height);
+
+    size_t cols = width / FONT_WIDTH, rows = height / FONT_HEIGHT;
+    const uint8_t *font  = &state[CAPTURE_ADDR(FONT_START)];
+    const uint8_t *cells = &state[CAPTURE_ADDR(DISPLAY_START)];
+
+    for (size_t dy = 0; dy < rows; ++dy) {
+        for (size_t dx = 0; dx < cols; ++dx) {
+            size_t cell = dy * cols + dx;
+            uint8_t *dst = &indices[(dy * FONT_HEIGHT) * width + (dx * FONT_WIDTH)];
+
+            if (cell >= DISPLAY_CELLS) {
+                for (size_t fy = 0; fy < FONT_HEIGHT; ++fy, dst += width)
+                    memset(dst, 0x0, FONT_WIDTH);
+                continue;
+            }
+
+            size_t glyph = cell_glyph(cells[cell * 2 + 0]);
+            uint8_t attr = cells[cell * 2 + 1];
+
+            uint8_t tile[TILE_SIZE];
+            expand8(tile, &font[glyph * TILE_SIZE], TILE_SIZE, attr & 0xF, attr >> 4);
+
+            for (size_t fy = 0; fy < FONT_HEIGHT; ++fy, dst += width)
+                memcpy(dst, &tile[fy * FONT_WIDTH], FONT_WIDTH);
+        }
+    }
+}
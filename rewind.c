@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+
+// Rewinding: the machine state after every step is kept in a ring (see
+// ring.c), as a delta against the step before, so that a running cartridge
+// can be paused and stepped back and forth through its recent past. F7 steps
+// back (pausing first), F8 steps forward again, and F6 carries on from the
+// state shown, forgetting the ones after it.
+//
+// The state is everything the machine holds: the banks, the current bank,
+// color, mode and step counts, and the state of `rand`. The script's own
+// variables live in fe or Janet and aren't rewound.
+
+#define REWIND_BYTES (16 * 1024 * 1024)
+
+struct RewindHeader {
+    struct Mode mode;
+    size_t bank;
+    uint8_t color;
+    uint64_t rng;
+};
+
+static struct {
+    struct Ring ring;
+    struct RingCursor cursor;
+    uint8_t *state;
+    _Bool paused;
+} rw = {0};
+
+static size_t state_size(void) {
+    return sizeof(struct RewindHeader) + bank_count * MEMORY_SIZE;
+}
+
+static void save_state(uint8_t *state) {
+    // Cleared first, so that the padding doesn't show up as a change.
+    struct RewindHeader h;
+    memset(&h, 0x0, sizeof(h));
+    h.mode = mode;
+    h.bank = bank;
+    h.color = color;
+    h.rng = rng_state;
+    memcpy(state, &h, sizeof(h));
+
+    for (size_t bk = 0; bk < bank_count; ++bk)
+        memcpy(&state[sizeof(h) + bk * MEMORY_SIZE], memory[bk], MEMORY_SIZE);
+}
+
+static void load_state(const uint8_t *state) {
+    struct RewindHeader h;
+    memcpy(&h, state, sizeof(h));
+    mode = h.mode;
+    bank = h.bank;
+    color = h.color;
+    rng_state = h.rng;
+
+    for (size_t bk = 0; bk < bank_count; ++bk) {
+        bank_will_write(bk, 0, MEMORY_SIZE);
+        memcpy(memory[bk], &state[sizeof(h) + bk * MEMORY_SIZE], MEMORY_SIZE);
+        mark_dirty(bk, 0, MEMORY_SIZE);
+    }
+    mark_all_dirty();
+}
+
+_Bool rewind_active(void) {
+    return rw.ring.buf != NULL;
+}
+
+_Bool rewind_paused(void) {
+    return rw.paused;
+}
+
+void rewind_init(void) {
+    if (rewind_active())
+        return;
+
+    ring_init(&rw.ring, REWIND_BYTES, state_size(), 0);
+    rw.state = ecalloc(state_size(), sizeof(uint8_t));
+}
+
+void rewind_deinit(void) {
+    if (!rewind_active())
+        return;
+
+    ring_deinit(&rw.ring);
+    free(rw.state);
+    rw.state = NULL;
+    rw.paused = false;
+}
+
+// Keep the state after a step.
+void rewind_step(void) {
+    if (!rewind_active())
+        return;
+
+    // The cartridge was loaded again with a different number of banks.
+    if (rw.ring.state_size != state_size()) {
+        rewind_deinit();
+        rewind_init();
+    }
+
+    save_state(rw.state);
+    ring_push(&rw.ring, rw.state);
+}
+
+static void report(void) {
+    log_message("rewind: step %zu of %zu%s\n", rw.cursor.index + 1,
+        rw.ring.frames, rw.paused ? ", paused" : "");
+}
+
+void rewind_back(void) {
+    if (!rewind_active() || rw.ring.frames == 0)
+        return;
+
+    if (!rw.paused) {
+        ring_cursor_last(&rw.ring, &rw.cursor, rw.state);
+        rw.paused = true;
+    }
+
+    if (ring_cursor_prev(&rw.cursor))
+        load_state(rw.state);
+    report();
+}
+
+void rewind_forward(void) {
+    if (!rw.paused)
+        return;
+
+    if (ring_cursor_next(&rw.cursor))
+        load_state(rw.state);
+    report();
+}
+
+// Carry on from the state shown.
+void rewind_resume(void) {
+    if (!rw.paused)
+        return;
+
+    ring_truncate(&rw.ring, &rw.cursor);
+    rw.paused = false;
+    report();
+}
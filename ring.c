@@ -0,0 +1,258 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+
+// A fixed-size ring of machine states, each stored as a delta against the
+// one before it. Only the oldest and newest states are kept whole; the ones
+// in between are rebuilt by walking forward from the oldest, or back from
+// the newest.
+//
+// Each record is the delta between two states, with its 32-bit length both
+// before and after it so that it can be found from either end. The delta is
+// the XOR of the two states, run-length coded as (zero run, literal count,
+// literal bytes) triples with both counts as varints. Records may wrap around
+// the end of the buffer. When there's no room for a new record, the oldest
+// one is folded into the base state and dropped.
+
+// Zero runs shorter than this are cheaper to store as literals.
+#define MIN_ZERO_RUN 4
+
+// Length, delta, length.
+#define RECORD_SIZE(len) (4 + (len) + 4)
+
+static uint8_t ring_byte(const struct Ring *r, size_t off) {
+    return r->buf[off % r->size];
+}
+
+static void ring_put(struct Ring *r, size_t off, const uint8_t *src, size_t n) {
+    off %= r->size;
+    size_t first = MIN(n, r->size - off);
+    memcpy(&r->buf[off], src, first);
+    memcpy(r->buf, src + first, n - first);
+}
+
+static size_t ring_len(const struct Ring *r, size_t off) {
+    uint8_t bytes[4];
+    for (size_t i = 0; i < 4; ++i)
+        bytes[i] = ring_byte(r, off + i);
+    return decode_u32_from_bytes(bytes);
+}
+
+static size_t put_varint(uint8_t *dst, size_t v) {
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+        dst[n++] = (v & 0x7F) | 0x80;
+    dst[n++] = v;
+    return n;
+}
+
+static size_t get_varint(const struct Ring *r, size_t *off) {
+    size_t v = 0;
+    for (size_t shift = 0;; shift += 7) {
+        uint8_t byte = ring_byte(r, (*off)++);
+        v |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return v;
+    }
+}
+
+static size_t encode_delta(uint8_t *dst, const uint8_t *prev, const uint8_t *cur, size_t sz) {
+    size_t len = 0;
+    size_t i = 0;
+
+    while (i < sz) {
+        size_t skip = i;
+        while (i < sz && prev[i] == cur[i])
+            ++i;
+        if (i == sz)
+            break;
+        skip = i - skip;
+
+        // Extend the literal until the next long enough run of zeroes.
+        size_t start = i, zeroes = 0;
+        for (; i < sz && zeroes < MIN_ZERO_RUN; ++i)
+            zeroes = prev[i] == cur[i] ? zeroes + 1 : 0;
+        i -= zeroes;
+
+        len += put_varint(&dst[len], skip);
+        len += put_varint(&dst[len], i - start);
+        for (size_t j = start; j < i; ++j)
+            dst[len++] = prev[j] ^ cur[j];
+    }
+
+    return len;
+}
+
+// XOR the record at off into state. Deltas are symmetric, so this moves
+// state one step forward (or, from the newer side, one step back).
+static void apply_delta(const struct Ring *r, size_t off, uint8_t *state) {
+    size_t len = ring_len(r, off);
+    size_t end = off + 4 + len;
+    size_t pos = 0;
+
+    for (off += 4; off < end;) {
+        pos += get_varint(r, &off);
+        size_t n = get_varint(r, &off);
+        for (size_t i = 0; i < n; ++i)
+            state[pos++] ^= ring_byte(r, off++);
+    }
+}
+
+void ring_init(struct Ring *r, size_t size, size_t state_size, size_t max_frames) {
+    r->buf = ecalloc(size, sizeof(uint8_t));
+    r->size = size;
+    r->state_size = state_size;
+    r->max_frames = max_frames;
+    r->base = ecalloc(state_size, sizeof(uint8_t));
+    r->last = ecalloc(state_size, sizeof(uint8_t));
+
+    // Literals never add up to more than the state itself; the rest is room
+    // for the run counts.
+    r->scratch = ecalloc(state_size * 2 + 16, sizeof(uint8_t));
+
+    ring_clear(r);
+}
+
+void ring_deinit(struct Ring *r) {
+    free(r->buf);
+    free(r->base);
+    free(r->last);
+    free(r->scratch);
+    memset(r, 0x0, sizeof(*r));
+}
+
+void ring_clear(struct Ring *r) {
+    r->head = r->used = 0;
+    r->frames = 0;
+}
+
+// Make dst an independent copy of src.
+void ring_copy(struct Ring *dst, const struct Ring *src) {
+    ring_init(dst, src->size, src->state_size, src->max_frames);
+    memcpy(dst->buf, src->buf, src->size);
+    memcpy(dst->base, src->base, src->state_size);
+    memcpy(dst->last, src->last, src->state_size);
+    dst->head = src->head;
+    dst->used = src->used;
+    dst->frames = src->frames;
+}
+
+static void ring_evict(struct Ring *r) {
+    size_t len = ring_len(r, r->head);
+    apply_delta(r, r->head, r->base);
+    r->head = (r->head + RECORD_SIZE(len)) % r->size;
+    r->used -= RECORD_SIZE(len);
+    --r->frames;
+}
+
+void ring_push(struct Ring *r, const uint8_t *state) {
+    if (r->frames == 0) {
+        memcpy(r->base, state, r->state_size);
+        memcpy(r->last, state, r->state_size);
+        r->frames = 1;
+        return;
+    }
+
+    size_t len = encode_delta(r->scratch, r->last, state, r->state_size);
+    size_t need = RECORD_SIZE(len);
+
+    if (need > r->size) {
+        // Doesn't fit even in an empty ring; start over from this state.
+        ring_clear(r);
+        ring_push(r, state);
+        return;
+    }
+
+    while (r->used > 0 && (r->size - r->used < need ||
+            (r->max_frames > 0 && r->frames >= r->max_frames)))
+        ring_evict(r);
+
+    uint8_t header[4] = {
+        (len >>  0) & 0xFF, (len >>  8) & 0xFF,
+        (len >> 16) & 0xFF, (len >> 24) & 0xFF,
+    };
+    size_t tail = r->head + r->used;
+    ring_put(r, tail, header, sizeof(header));
+    ring_put(r, tail + 4, r->scratch, len);
+    ring_put(r, tail + 4 + len, header, sizeof(header));
+
+    r->used += need;
+    ++r->frames;
+    memcpy(r->last, state, r->state_size);
+}
+
+// Walk the stored states from oldest to newest. The caller owns state, which
+// must be state_size bytes; it holds the current state after each call.
+void ring_iter_start(const struct Ring *r, struct RingIter *it, uint8_t *state) {
+    it->ring = r;
+    it->off = r->head;
+    it->left = r->frames;
+    it->state = state;
+    it->started = false;
+}
+
+_Bool ring_iter_next(struct RingIter *it) {
+    const struct Ring *r = it->ring;
+
+    if (it->left == 0)
+        return false;
+    --it->left;
+
+    if (!it->started) {
+        memcpy(it->state, r->base, r->state_size);
+        it->started = true;
+        return true;
+    }
+
+    apply_delta(r, it->off, it->state);
+    it->off = (it->off + RECORD_SIZE(ring_len(r, it->off))) % r->size;
+    return true;
+}
+
+// Step through the stored states in either direction, starting from the
+// newest. As with an iterator, the caller owns state.
+void ring_cursor_last(const struct Ring *r, struct RingCursor *c, uint8_t *state) {
+    c->ring = r;
+    c->off = (r->head + r->used) % r->size;
+    c->index = r->frames - 1;
+    c->state = state;
+    memcpy(state, r->last, r->state_size);
+}
+
+_Bool ring_cursor_prev(struct RingCursor *c) {
+    const struct Ring *r = c->ring;
+
+    if (c->index == 0)
+        return false;
+
+    size_t len = ring_len(r, (c->off + r->size - 4) % r->size);
+    c->off = (c->off + r->size - RECORD_SIZE(len)) % r->size;
+    apply_delta(r, c->off, c->state);
+    --c->index;
+    return true;
+}
+
+_Bool ring_cursor_next(struct RingCursor *c) {
+    const struct Ring *r = c->ring;
+
+    if (c->index + 1 >= r->frames)
+        return false;
+
+    apply_delta(r, c->off, c->state);
+    c->off = (c->off + RECORD_SIZE(ring_len(r, c->off))) % r->size;
+    ++c->index;
+    return true;
+}
+
+// Forget every state after the cursor's, which becomes the newest.
+void ring_truncate(struct Ring *r, const struct RingCursor *c) {
+    // Also covers a full ring, where the end of the newest record is head.
+    if (c->index + 1 >= r->frames)
+        return;
+
+    r->used = (c->off + r->size - r->head) % r->size;
+    r->frames = c->index + 1;
+    memcpy(r->last, c->state, r->state_size);
+}
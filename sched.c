@@ -0,0 +1,100 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "cel7ce.h"
+
+// How many steps may be run back-to-back to catch up after a stall. Anything
+// beyond that is dropped, so that a long hiccup doesn't turn into a burst of
+// fast-forwarded frames.
+#define MAX_CATCHUP 4
+
+struct Scheduler sched = {0};
+
+uint64_t sched_now(void) {
+    if (sched.virtual_clock)
+        return sched.virtual_now;
+    return SDL_GetPerformanceCounter();
+}
+
+// Move the virtual clock forward by one step period.
+void sched_advance(void) {
+    sched.virtual_now += sched.period;
+}
+
+// An fps that isn't a positive number is a mistake in the cartridge, not a
+// reason to quit. It's replaced with the default, in config too, so that
+// everything else that goes by config.fps agrees with the schedule.
+void sched_init(double fps) {
+    if (!isnormal(fps) || fps < 0) {
+        log_message("Invalid fps value %f, using %d.\n", fps, DEFAULT_FPS);
+        fps = DEFAULT_FPS;
+        config.fps = fps;
+    }
+
+    // The virtual clock counts microseconds, so that runs are reproducible
+    // regardless of the host's counter frequency.
+    sched.freq   = sched.virtual_clock ? 1000000 : SDL_GetPerformanceFrequency();
+    sched.period = (uint64_t)round(sched.freq / fps);
+    if (sched.period == 0)
+        sched.period = 1;
+
+    sched.next        = sched_now() + sched.period;
+    sched.delay_until = 0;
+}
+
+// Carry on from now after not running for a while, without owing any of the
+// steps that would have been due in between.
+void sched_resume(void) {
+    sched.next = sched_now() + sched.period;
+}
+
+void sched_delay(double seconds) {
+    sched.delay_until = sched_now() + (uint64_t)(seconds * sched.freq);
+}
+
+_Bool sched_holding(void) {
+    return sched.delay_until != 0 && sched_now() < sched.delay_until;
+}
+
+// Milliseconds until the next step is due, for use as an event wait timeout.
+uint32_t sched_timeout(void) {
+    uint64_t now  = sched_now();
+    uint64_t wake = MAX(sched.next, sched.delay_until);
+
+    if (now >= wake)
+        return 0;
+
+    // Round up, so that we don't wake up just before the deadline and spin.
+    return (uint32_t)(((wake - now) * 1000 + sched.freq - 1) / sched.freq);
+}
+
+// Returns the number of steps that should be run right now (usually zero or
+// one), advancing the schedule past them.
+size_t sched_due(void) {
+    uint64_t now = sched_now();
+
+    if (now < sched.next)
+        return 0;
+
+    size_t due = (now - sched.next) / sched.period + 1;
+    sched.next += due * sched.period;
+
+    if (sched.delay_until != 0) {
+        if (now < sched.delay_until)
+            return 0;
+
+        // Ticks that elapsed during a delay() aren't owed to anyone.
+        sched.delay_until = 0;
+        due = 1;
+    }
+
+    if (due > MAX_CATCHUP) {
+        sched.dropped += due - MAX_CATCHUP;
+        due = MAX_CATCHUP;
+    }
+
+    sched.late  += due - 1;
+    sched.steps += due;
+
+    return due;
+}
@@ -0,0 +1,40 @@
+// Allocation counting for the bench binary. It's linked with
+// -Wl,--wrap=malloc (etc.), so every call to these from cel7ce or the
+// interpreters goes through the wrappers below.
+
+#include <stddef.h>
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+extern size_t (*alloc_counter)(void);
+
+static size_t count = 0;
+
+void *__wrap_malloc(size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+static size_t get_count(void) {
+    return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+__attribute__((constructor)) static void install(void) {
+    alloc_counter = get_count;
+}
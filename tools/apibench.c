@@ -0,0 +1,185 @@
+// Microbenchmark for the fe and Janet API bindings.
+//
+// Each case is a call as it would appear in a cartridge. Its arguments are
+// built once up front, and then the binding is called directly in a loop, so
+// the numbers include argument unmarshalling, address checks and the work
+// itself, but not the interpreter's own dispatch.
+//
+// Prints one line of JSON per case: {"lang", "call", "calls", "ns_per_call"}.
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+#include "fe.h"
+#include "janet.h"
+
+static const char *fe_cases[] = {
+    "(poke 256 65)",
+    "(poke 256 \"0123456789abcdef\")",
+    "(peek 256)",
+    "(peek 256 16)",
+    "(peekl 256 16)",
+    "(poke 256 '(1 2 3 4 5 6 7 8))",
+    "(peek32 0x4004)",
+    "(poke32 0x4004 0xC00000)",
+    "(memcpy 0 0x4040 1 0x4040 4704)",
+    "(memset 0 0x4040 0 4704)",
+    "(color 5)",
+    "(put 1 1 \"hello\")",
+    "(putc 1 1 \"hello\" '(1 2 3 4 5))",
+    "(get 1 1)",
+    "(fill 0 0 1 1 \"x\")",
+    "(fill 0 0 24 16 \"x\")",
+    "(blit 0 1 24 15 0 0)",
+    "(scroll 0 -1)",
+    "(strlen \"hello world\")",
+    "(strstart \"hello\" \"he\")",
+    "(strat \"hello\" 1)",
+    "(char->num \"a\")",
+    "(num->char 97)",
+    "(rand 10)",
+    "(// 7 2)",
+    "(% 7 2)",
+    "(ticks)",
+    "(swibnk 0)",
+};
+
+static const struct {
+    const char *name;
+    const char *args;
+} janet_cases[] = {
+    { "poke",   "[256 65]" },
+    { "poke",   "[256 \"0123456789abcdef\"]" },
+    { "peek",   "[256]" },
+    { "peek",   "[256 16]" },
+    { "memcpy", "[0 0x4040 1 0x4040 4704]" },
+    { "memset", "[0 0x4040 0 4704]" },
+    { "view",   "[0 0x4040 4704]" },
+    { "color",  "[5]" },
+    { "c7put",  "[1 1 \"hello\"]" },
+    { "c7putc", "[1 1 \"hello\" @[1 2 3 4 5]]" },
+    { "c7get",  "[1 1]" },
+    { "fill",   "[0 0 1 1 \"x\"]" },
+    { "fill",   "[0 0 24 16 \"x\"]" },
+    { "blit",   "[0 1 24 15 0 0]" },
+    { "scroll", "[0 -1]" },
+    { "rand",   "[10]" },
+    { "//",     "[7 2]" },
+    { "ticks",  "[]" },
+    { "swibnk", "[0]" },
+};
+
+static size_t iterations = 200000;
+
+static double elapsed_ns(uint64_t since) {
+    uint64_t now = SDL_GetPerformanceCounter();
+    return (double)(now - since) * 1e9 / SDL_GetPerformanceFrequency();
+}
+
+static void report(const char *lang, const char *call, double ns) {
+    printf("{\"lang\":\"%s\",\"call\":\"", lang);
+    for (const char *c = call; *c; ++c) {
+        if (*c == '"' || *c == '\\') putchar('\\');
+        putchar(*c);
+    }
+    printf("\",\"calls\":%zu,\"ns_per_call\":%.2f}\n", iterations, ns / iterations);
+}
+
+static fe_CFunc find_fe_api(const char *name) {
+    for (size_t i = 0; i < ARRAY_LEN(fe_apis); ++i) {
+        if (!strcmp(fe_apis[i].name, name))
+            return fe_apis[i].func;
+    }
+    errx(1, "No fe API '%s'\n", name);
+}
+
+static JanetCFunction find_janet_api(const char *name) {
+    for (size_t i = 0; janet_apis[i].name != NULL; ++i) {
+        if (!strcmp(janet_apis[i].name, name))
+            return janet_apis[i].cfun;
+    }
+    errx(1, "No Janet API '%s'\n", name);
+}
+
+static void bench_fe(const char *call) {
+    FILE *fp = fmemopen((void *)call, strlen(call), "r");
+    assert(fp != NULL);
+
+    int gc = fe_savegc(fe_ctx);
+    fe_Object *form = fe_readfp(fe_ctx, fp);
+    fclose(fp);
+
+    char name[32];
+    fe_tostring(fe_ctx, fe_car(fe_ctx, form), name, sizeof(name));
+    fe_CFunc func = find_fe_api(name);
+    fe_Object *args = fe_cdr(fe_ctx, form);
+
+    // Anything the binding allocates is garbage as soon as it returns.
+    int inner = fe_savegc(fe_ctx);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (size_t i = 0; i < iterations; ++i) {
+        func(fe_ctx, args);
+        fe_restoregc(fe_ctx, inner);
+    }
+    report("fe", call, elapsed_ns(start));
+
+    fe_restoregc(fe_ctx, gc);
+}
+
+static void bench_janet(const char *name, const char *args_src) {
+    Janet args;
+    if (janet_dostring(janet_env, args_src, "apibench", &args) != 0)
+        errx(1, "Couldn't evaluate '%s'\n", args_src);
+    janet_gcroot(args);
+
+    JanetCFunction func = find_janet_api(name);
+    const Janet *argv = janet_unwrap_tuple(args);
+    int32_t argc = janet_tuple_length(argv);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (size_t i = 0; i < iterations; ++i) {
+        func(argc, (Janet *)argv);
+
+        // There's no VM loop here to trigger collections, so do it by hand
+        // every so often, the way a running cartridge would.
+        if (i % 4096 == 4095)
+            janet_collect();
+    }
+
+    char call[128];
+    snprintf(call, sizeof(call), "(%s %.*s)", name,
+        (int)strlen(args_src) - 2, args_src + 1);
+    report("janet", call, elapsed_ns(start));
+
+    janet_gcunroot(args);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 0);
+    if (iterations == 0)
+        errx(1, "usage: %s [iterations]\n", argv[0]);
+
+    init_mem();
+    init_vm();
+    set_vals();
+
+    if (setjmp(fe_error_recover) == 1)
+        errx(1, "fe error during benchmark\n");
+
+    for (size_t i = 0; i < ARRAY_LEN(fe_cases); ++i)
+        bench_fe(fe_cases[i]);
+
+    for (size_t i = 0; i < ARRAY_LEN(janet_cases); ++i)
+        bench_janet(janet_cases[i].name, janet_cases[i].args);
+
+    deinit_vm();
+    deinit_mem();
+
+    return 0;
+}
@@ -0,0 +1,229 @@
+// Compile the builtin Janet scripts ahead of time.
+//
+// usage: mkimage out.c script.janet...
+//
+// Each script is read form by form, the way janet_dostring() would. Any
+// parse, compile or evaluation error fails the build, since the image would
+// be missing whatever came after it. Definitions are evaluated; every
+// other top-level form is only compiled, and saved to be run at startup, since
+// it may depend on the cartridge and the machine state. The new bindings and
+// the saved forms are marshalled into an image, written out as a C array that
+// load_builtins() in main.c unmarshals.
+//
+// Definitions run here, in this process, so they mustn't have side effects
+// that the cartridge relies on.
+//
+// The image is two marshalled values, one after the other:
+//   1. a tuple of the globals from set_vals() that the scripts use;
+//   2. a struct with :bindings, the new environment entries, and :startup,
+//      a tuple of [path thunks] pairs, one per script.
+// The globals in (1) are compiled as vars rather than constants, so that the
+// scripts see the cartridge's values and not the defaults.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cel7ce.h"
+#include "janet.h"
+
+// The globals set_vals() defines for Janet, which depend on the cartridge.
+// heap isn't one of them: it's only defined for fe, so a Janet script can't
+// refer to it.
+static const char *config_globals[] = {
+    "title", "width", "height", "scale", "fps", "replay", "debug", "banks",
+};
+
+static const char *definitions[] = {
+    "def", "def-", "defn", "defn-", "defmacro", "defmacro-",
+    "var", "var-", "varfn", "defglobal", "varglobal",
+};
+
+static _Bool is_definition(Janet form) {
+    if (!janet_checktype(form, JANET_TUPLE))
+        return false;
+
+    const Janet *tup = janet_unwrap_tuple(form);
+    if (janet_tuple_length(tup) == 0 || !janet_checktype(tup[0], JANET_SYMBOL))
+        return false;
+
+    for (size_t i = 0; i < ARRAY_LEN(definitions); ++i) {
+        if (!janet_cstrcmp(janet_unwrap_symbol(tup[0]), definitions[i]))
+            return true;
+    }
+    return false;
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        err(1, "Couldn't open '%s'", path);
+
+    fseek(fp, 0L, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+
+    char *buf = ecalloc(*len + 1, sizeof(char));
+    if (fread(buf, sizeof(char), *len, fp) != *len)
+        err(1, "Couldn't read '%s'", path);
+    fclose(fp);
+
+    return buf;
+}
+
+// Evaluate a compiled form now. Returns false if it failed.
+static _Bool evaluate(JanetFunction *thunk) {
+    JanetFiber *fiber = janet_fiber(thunk, 64, 0, NULL);
+    fiber->env = janet_env;
+
+    Janet ret;
+    JanetSignal status = janet_continue(fiber, janet_wrap_nil(), &ret);
+    if (status != JANET_SIGNAL_OK && status != JANET_SIGNAL_EVENT) {
+        janet_stacktrace(fiber, ret);
+        return false;
+    }
+    return true;
+}
+
+// Compile one top-level form: a definition is evaluated, anything else is
+// saved in thunks.
+static void compile_form(Janet form, const char *path, JanetArray *thunks) {
+    JanetCompileResult res = janet_compile(form, janet_env, janet_cstring(path));
+    if (res.status != JANET_COMPILE_OK) {
+        errx(1, "compile error in %s:%d: %s", path,
+            res.error_mapping.line, (const char *)res.error);
+    }
+
+    JanetFunction *thunk = janet_thunk(res.funcdef);
+    if (is_definition(form)) {
+        if (!evaluate(thunk))
+            errx(1, "couldn't evaluate a definition in %s", path);
+        return;
+    }
+
+    janet_array_push(thunks, janet_wrap_function(thunk));
+}
+
+// Compile a script, returning the forms to run at startup, in order.
+static JanetArray *compile_script(const char *path) {
+    size_t len;
+    char *src = read_file(path, &len);
+
+    JanetArray *thunks = janet_array(0);
+    janet_gcroot(janet_wrap_array(thunks));
+
+    JanetParser parser;
+    janet_parser_init(&parser);
+
+    size_t i = 0;
+    _Bool done = false;
+    while (!done) {
+        while (janet_parser_has_more(&parser))
+            compile_form(janet_parser_produce(&parser), path, thunks);
+
+        switch (janet_parser_status(&parser)) {
+        case JANET_PARSE_DEAD:
+            done = true;
+            break;
+        case JANET_PARSE_ERROR:
+            errx(1, "parse error in %s: %s", path, janet_parser_error(&parser));
+            break;
+        default:
+            if (i >= len)
+                janet_parser_eof(&parser);
+            else
+                janet_parser_consume(&parser, src[i++]);
+            break;
+        }
+    }
+
+    janet_parser_deinit(&parser);
+    janet_gcunroot(janet_wrap_array(thunks));
+    free(src);
+    return thunks;
+}
+
+static void write_image(const char *path, const JanetBuffer *image) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        err(1, "Couldn't open '%s'", path);
+
+    fprintf(fp, "// Generated by tools/mkimage; do not edit.\n\n");
+    fprintf(fp, "#include <stddef.h>\n\n");
+    fprintf(fp, "const unsigned char builtin_image[] = {");
+    for (int32_t i = 0; i < image->count; ++i)
+        fprintf(fp, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", image->data[i]);
+    fprintf(fp, "\n};\n\n");
+    fprintf(fp, "const size_t builtin_image_len = sizeof(builtin_image);\n");
+
+    if (fclose(fp) != 0)
+        err(1, "Couldn't write '%s'", path);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        errx(1, "usage: %s out.c script.janet...\n", argv[0]);
+
+    init_mem();
+    init_vm();
+    set_vals();
+
+    // Rebind the cartridge-dependent globals as vars, so that the scripts
+    // read them through a ref, which is swapped for one holding the
+    // cartridge's value at startup.
+    Janet names[ARRAY_LEN(config_globals)];
+    for (size_t i = 0; i < ARRAY_LEN(config_globals); ++i) {
+        names[i] = janet_csymbolv(config_globals[i]);
+        JanetBinding binding = janet_resolve_ext(janet_env, janet_unwrap_symbol(names[i]));
+        janet_var(janet_env, config_globals[i], binding.value, "");
+    }
+
+    JanetTable *rreg = reverse_registry(janet_env);
+    janet_gcroot(janet_wrap_table(rreg));
+
+    // Everything from here on goes into a child of the environment, so that
+    // the new bindings are easy to pick out.
+    JanetTable *base = janet_env;
+    janet_env = janet_table(0);
+    janet_env->proto = base;
+    janet_gcroot(janet_wrap_table(janet_env));
+
+    JanetArray *startup = janet_array(argc - 2);
+    janet_gcroot(janet_wrap_array(startup));
+
+    for (int i = 2; i < argc; ++i) {
+        JanetArray *thunks = compile_script(argv[i]);
+        Janet pair[2] = {
+            janet_cstringv(argv[i]),
+            janet_wrap_tuple(janet_tuple_n(thunks->data, thunks->count)),
+        };
+        janet_array_push(startup, janet_wrap_tuple(janet_tuple_n(pair, 2)));
+    }
+
+    JanetTable *bindings = janet_table(janet_env->count);
+    for (int32_t i = 0; i < janet_env->capacity; ++i) {
+        JanetKV *kv = &janet_env->data[i];
+        if (janet_checktype(kv->key, JANET_SYMBOL))
+            janet_table_put(bindings, kv->key, kv->value);
+    }
+
+    JanetKV *image = janet_struct_begin(2);
+    janet_struct_put(image, janet_ckeywordv("bindings"), janet_wrap_table(bindings));
+    janet_struct_put(image, janet_ckeywordv("startup"),
+        janet_wrap_tuple(janet_tuple_n(startup->data, startup->count)));
+
+    JanetBuffer *buf = janet_buffer(1 << 16);
+    janet_marshal(buf, janet_wrap_tuple(janet_tuple_n(names, ARRAY_LEN(names))), NULL, 0);
+    janet_marshal(buf, janet_wrap_struct(janet_struct_end(image)), rreg, 0);
+    write_image(argv[1], buf);
+
+    janet_gcunroot(janet_wrap_array(startup));
+    janet_gcunroot(janet_wrap_table(janet_env));
+    janet_gcunroot(janet_wrap_table(rreg));
+    janet_env = base;
+
+    deinit_vm();
+    deinit_mem();
+
+    return 0;
+}
@@ -26,6 +26,13 @@ void *ecalloc(size_t nmemb, size_t size) {
     return ptr;
 }
 
+void log_message(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
 // Improved function to handle unreachable code
 _Noreturn void __unreachable(const char *file, const char *func, int line) {
     fprintf(stderr, "[BUG] Entered unreachable code at %s:%s:%d.\n", file, func, line);
@@ -57,6 +64,43 @@ uint32_t decode_u32_from_bytes(uint8_t *bytes) {
     return accm;
 }
 
+// The cartridge's source while load_fe() reads it, so that it can be closed
+// if an fe error longjmps out.
+static FILE *fe_source = NULL;
+
+// Evaluate an fe cartridge. Errors longjmp to fe_error_recover, which the
+// caller has to have set. Returns false if the cartridge set heap to more
+// than it has, in which case fe has been restarted with that much and the
+// cartridge has to be evaluated again from the top.
+static _Bool load_fe(char *start, size_t len) {
+    cache_begin(LM_Fe, start, len);
+
+    fe_source = fmemopen(start, len, "r");
+    assert(fe_source != NULL);
+
+    ssize_t gc = fe_savegc(fe_ctx);
+    while (true) {
+        fe_Object *obj = cache_read_fe(fe_ctx, fe_source);
+
+        if (!obj) break;
+
+        fe_eval(fe_ctx, obj);
+
+        fe_restoregc(fe_ctx, gc);
+    }
+    fclose(fe_source);
+    fe_source = NULL;
+
+    cache_end(true);
+
+    size_t want = get_number_global("heap");
+    if (want > fe_heap.size && restart_fe(want)) {
+        set_vals();
+        return false;
+    }
+    return true;
+}
+
 // Load function enhanced for better error handling and cross-platform support
 void load(char *user_filename) {
     bool fileisbin = false;
@@ -128,50 +172,270 @@ void load(char *user_filename) {
         }
     }
 
+    size_t len = st.st_size - (start - filebuf);
+
     if (lang == LM_Fe) {
+        // An fe error, from the cartridge or from reading its globals below,
+        // ends up here. If fe ran out of memory, it's restarted with twice the
+        // heap and the cartridge evaluated again from the top.
+rearm:;
         if (setjmp(fe_error_recover) == 1) {
+            if (fe_source != NULL) {
+                fclose(fe_source);
+                fe_source = NULL;
+            }
+            cache_end(false);
+
+            if (fe_heap.exhausted && restart_fe(fe_heap.size * 2)) {
+                set_vals();
+                goto rearm;
+            }
+            free(filebuf);
             load_error = true;
             return;
         }
 
-        FILE *fakefp = fmemopen(start, st.st_size - (start - filebuf), "r");
-        assert(fakefp != NULL);
-
-        ssize_t gc = fe_savegc(fe_ctx);
-        while (true) {
-            fe_Object *obj = fe_readfp(fe_ctx, fakefp);
-
-            if (!obj) break;
-
-            fe_eval(fe_ctx, obj);
-
-            fe_restoregc(fe_ctx, gc);
-        }
+        while (!load_fe(start, len))
+            ;
     } else {
-        if (janet_dostring(janet_env, start, filename, NULL) != 0) {
+        cache_begin(lang, start, len);
+        if (!cache_run_janet(start, len, filename)) {
+            cache_end(false);
+            free(filebuf);
             load_error = true;
             return;
         }
+        cache_end(true);
     }
 
     get_string_global("title", config.title, sizeof(config.title));
     config.width = get_number_global("width");
     config.height = get_number_global("height");
     config.scale = get_number_global("scale");
+    config.fps = get_number_global("fps");
+    config.replay = get_number_global("replay");
+
+    float banks = get_number_global("banks");
+    resize_banks(banks > 0 ? (size_t)banks : 0);
+
+    free(filebuf);
+}
+
+// Callbacks are called by name on every step and input event, so what each
+// name resolves to is cached. fe symbols are interned and never collected, and
+// their current value is read on every call. For Janet, the environment entry
+// the function was found in is kept (and rooted); a different entry means the
+// name was redefined and has to be resolved again. Vars are read through their
+// ref, so set! is picked up without a new lookup.
+#define MAX_CALLBACKS  32
+#define MAX_CALL_ARGS  8
+#define CACHED_STRINGS 16
+
+struct CachedCallback {
+    const char *name;
+
+    fe_Object *fe_sym;
+
+    _Bool j_resolved;
+    Janet j_sym;
+    Janet j_entry;
+    JanetArray *j_ref;      // Non-NULL for vars
+    Janet j_value;          // The value, for defs
+};
+
+static struct CachedCallback cached_callbacks[MAX_CALLBACKS];
+static size_t cached_callbacks_len = 0;
+
+// Recently passed Janet string arguments (key and button names, mostly), so
+// that a flood of mouse motion doesn't allocate a new "motion" every time.
+static struct {
+    _Bool used;
+    char str[32];
+    Janet value;
+} cached_strings[CACHED_STRINGS];
+static size_t cached_strings_next = 0;
+
+// Reused by every Janet call, rather than making a new fiber each time.
+static JanetFiber *call_fiber = NULL;
+
+// Forget everything cached, for when the interpreters have been (re)started.
+void reset_call_cache(void) {
+    memset(cached_callbacks, 0x0, sizeof(cached_callbacks));
+    memset(cached_strings, 0x0, sizeof(cached_strings));
+    cached_callbacks_len = 0;
+    cached_strings_next = 0;
+    call_fiber = NULL;
+}
+
+// Forget the fe symbols only, for when fe alone has been restarted.
+void reset_fe_call_cache(void) {
+    for (size_t i = 0; i < cached_callbacks_len; ++i)
+        cached_callbacks[i].fe_sym = NULL;
 }
 
-// Improved call_func with better memory management and error handling
+static struct CachedCallback *find_callback(const char *fnname) {
+    for (size_t i = 0; i < cached_callbacks_len; ++i) {
+        struct CachedCallback *cb = &cached_callbacks[i];
+        if (cb->name == fnname || !strcmp(cb->name, fnname))
+            return cb;
+    }
+
+    // Callback names are all string constants, so this can't fill up.
+    assert(cached_callbacks_len < MAX_CALLBACKS);
+    struct CachedCallback *cb = &cached_callbacks[cached_callbacks_len++];
+    cb->name = fnname;
+    return cb;
+}
+
+static fe_Object *resolve_fe(struct CachedCallback *cb) {
+    if (cb->fe_sym == NULL) {
+        int gc = fe_savegc(fe_ctx);
+        cb->fe_sym = fe_symbol(fe_ctx, cb->name);
+        fe_restoregc(fe_ctx, gc);
+    }
+    return cb->fe_sym;
+}
+
+// Returns the binding's current value, or nil if it isn't bound.
+static Janet resolve_janet(struct CachedCallback *cb) {
+    if (!cb->j_resolved) {
+        cb->j_sym = janet_csymbolv(cb->name);
+        janet_gcroot(cb->j_sym);
+        cb->j_entry = janet_wrap_nil();
+        cb->j_resolved = true;
+    }
+
+    Janet entry = janet_table_get(janet_env, cb->j_sym);
+    if (!janet_equals(entry, cb->j_entry)) {
+        janet_gcunroot(cb->j_entry);
+        janet_gcroot(entry);
+        cb->j_entry = entry;
+        cb->j_ref = NULL;
+        cb->j_value = janet_wrap_nil();
+
+        JanetBinding binding = janet_resolve_ext(janet_env, janet_unwrap_symbol(cb->j_sym));
+        if (binding.type == JANET_BINDING_VAR && janet_checktype(entry, JANET_TABLE)) {
+            Janet ref = janet_table_get(janet_unwrap_table(entry), janet_ckeywordv("ref"));
+            if (janet_checktype(ref, JANET_ARRAY))
+                cb->j_ref = janet_unwrap_array(ref);
+        }
+        if (cb->j_ref == NULL && binding.type != JANET_BINDING_NONE)
+            cb->j_value = binding.value;
+    }
+
+    if (cb->j_ref != NULL)
+        return cb->j_ref->count > 0 ? cb->j_ref->data[0] : janet_wrap_nil();
+    return cb->j_value;
+}
+
+static Janet janet_arg_string(const char *str) {
+    size_t len = strlen(str);
+    if (len >= sizeof(cached_strings[0].str))
+        return janet_stringv((const uint8_t *)str, len);
+
+    for (size_t i = 0; i < CACHED_STRINGS; ++i) {
+        if (cached_strings[i].used && !strcmp(cached_strings[i].str, str))
+            return cached_strings[i].value;
+    }
+
+    Janet value = janet_stringv((const uint8_t *)str, len);
+
+    // Janet strings are immutable, so they can be handed out again safely.
+    size_t slot = cached_strings_next;
+    cached_strings_next = (cached_strings_next + 1) % CACHED_STRINGS;
+    if (cached_strings[slot].used)
+        janet_gcunroot(cached_strings[slot].value);
+
+    cached_strings[slot].used = true;
+    strcpy(cached_strings[slot].str, str);
+    cached_strings[slot].value = value;
+    janet_gcroot(value);
+
+    return value;
+}
+
+_Bool func_exists(const char *fnname) {
+    struct CachedCallback *cb = find_callback(fnname);
+
+    if (lang == LM_Fe && mode.cur == MT_Normal)
+        return fe_type(fe_ctx, fe_eval(fe_ctx, resolve_fe(cb))) == FE_TFUNC;
+    return janet_checktype(resolve_janet(cb), JANET_FUNCTION);
+}
+
+// A list of events, each one a list of the callback's name and the arguments
+// it would have been called with: ("keydown" name) or ("mouse" button n x y).
+static fe_Object *fe_events(const struct InputEvent *events, size_t count) {
+    fe_Object *list = fe_bool(fe_ctx, 0);
+
+    // Built back to front, keeping only the list itself on the GC stack,
+    // which is small.
+    for (size_t i = count; i > 0; --i) {
+        const struct InputEvent *ev = &events[i - 1];
+        int gc = fe_savegc(fe_ctx);
+
+        fe_Object *objs[5];
+        size_t len = 2;
+        objs[1] = fe_string(fe_ctx, ev->name);
+
+        if (ev->kind == IK_Mouse) {
+            objs[0] = fe_string(fe_ctx, "mouse");
+            objs[2] = fe_number(fe_ctx, ev->n);
+            objs[3] = fe_number(fe_ctx, ev->x);
+            objs[4] = fe_number(fe_ctx, ev->y);
+            len = 5;
+        } else {
+            objs[0] = fe_string(fe_ctx, "keydown");
+        }
+
+        list = fe_cons(fe_ctx, fe_list(fe_ctx, objs, len), list);
+        fe_restoregc(fe_ctx, gc);
+        fe_pushgc(fe_ctx, list);
+    }
+
+    return list;
+}
+
+// The same, as an array of tuples.
+static Janet janet_events(const struct InputEvent *events, size_t count) {
+    JanetArray *array = janet_array(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct InputEvent *ev = &events[i];
+
+        if (ev->kind == IK_Mouse) {
+            Janet items[5] = {
+                janet_arg_string("mouse"), janet_arg_string(ev->name),
+                janet_wrap_number(ev->n), janet_wrap_number(ev->x),
+                janet_wrap_number(ev->y),
+            };
+            janet_array_push(array, janet_wrap_tuple(janet_tuple_n(items, 5)));
+        } else {
+            Janet items[2] = { janet_arg_string("keydown"), janet_arg_string(ev->name) };
+            janet_array_push(array, janet_wrap_tuple(janet_tuple_n(items, 2)));
+        }
+    }
+
+    return janet_wrap_array(array);
+}
+
+// Call a script function if it's defined. Each character of arg_fmt is one
+// argument: 's' for a string, 'n' for a number (as a double), or 'e' for a
+// list of input events (a pointer to struct InputEvent and a size_t count).
 void call_func(const char *fnname, const char *arg_fmt, ...) {
     size_t argc = strlen(arg_fmt);
+    assert(argc <= MAX_CALL_ARGS);
+
     va_list ap;
     va_start(ap, arg_fmt);
 
+    struct CachedCallback *cb = find_callback(fnname);
+
     if (lang == LM_Fe && mode.cur == MT_Normal) {
-        fe_Object *fnsym = fe_symbol(fe_ctx, fnname);
+        fe_Object *fnsym = resolve_fe(cb);
         if (fe_type(fe_ctx, fe_eval(fe_ctx, fnsym)) == FE_TFUNC) {
             int gc = fe_savegc(fe_ctx);
 
-            fe_Object **objs = calloc(argc + 1, sizeof(fe_Object *));
+            fe_Object *objs[MAX_CALL_ARGS + 1];
             objs[0] = fnsym;
 
             for (size_t i = 0; i < argc; ++i) {
@@ -182,56 +446,77 @@ void call_func(const char *fnname, const char *arg_fmt, ...) {
                     case 'n':
                         objs[i + 1] = fe_number(fe_ctx, (float)va_arg(ap, double));
                         break;
+                    case 'e': {
+                        const struct InputEvent *events = va_arg(ap, const struct InputEvent *);
+                        objs[i + 1] = fe_events(events, va_arg(ap, size_t));
+                        break;
+                    }
                     default:
                         __unreachable(__FILE__, __func__, __LINE__);
                 }
             }
 
             fe_eval(fe_ctx, fe_list(fe_ctx, objs, argc + 1));
-            free(objs);
             fe_restoregc(fe_ctx, gc);
         }
     } else {
-        JanetSymbol j_sym = janet_csymbol(fnname);
-        JanetBinding j_binding = janet_resolve_ext(janet_env, j_sym);
-        if (j_binding.type != JANET_BINDING_NONE) {
-            if (!janet_checktype(j_binding.value, JANET_FUNCTION)) {
+        Janet fn = resolve_janet(cb);
+        if (!janet_checktype(fn, JANET_NIL)) {
+            if (!janet_checktype(fn, JANET_FUNCTION)) {
                 janet_panicf("Binding '%s' must be a function", fnname);
             }
 
-            Janet *args = calloc(argc, sizeof(Janet));
+            Janet args[MAX_CALL_ARGS];
             for (size_t i = 0; i < argc; ++i) {
                 switch (arg_fmt[i]) {
-                    case 's': {
-                        char *str = va_arg(ap, void *);
-                        args[i] = janet_stringv((const uint8_t *)str, strlen(str));
+                    case 's':
+                        args[i] = janet_arg_string(va_arg(ap, char *));
                         break;
-                    }
                     case 'n':
                         args[i] = janet_wrap_number(va_arg(ap, double));
                         break;
+                    case 'e': {
+                        const struct InputEvent *events = va_arg(ap, const struct InputEvent *);
+                        args[i] = janet_events(events, va_arg(ap, size_t));
+                        break;
+                    }
                     default:
                         __unreachable(__FILE__, __func__, __LINE__);
                 }
             }
 
+            // Resetting a fiber that's running would be a disaster, so calls
+            // made from inside Janet get a fiber of their own.
+            JanetFiber *fresh = NULL;
+            JanetFiber **fiber = janet_current_fiber() == NULL ? &call_fiber : &fresh;
+            _Bool new_fiber = *fiber == NULL;
+
             Janet res;
-            JanetFiber *fiber = janet_current_fiber();
-            JanetFunction *j_fn = janet_unwrap_function(j_binding.value);
-            JanetSignal sig = janet_pcall(j_fn, argc, args, &res, &fiber);
+            JanetSignal sig = janet_pcall(janet_unwrap_function(fn), argc, args, &res, fiber);
+
+            if (fiber == &call_fiber && new_fiber)
+                janet_gcroot(janet_wrap_fiber(call_fiber));
 
             if (sig == JANET_SIGNAL_ERROR) {
-                janet_stacktrace(fiber, res);
+                janet_stacktrace(*fiber, res);
                 mode.cur = MT_Error;
             }
-
-            free(args);
         }
     }
 
     va_end(ap);
 }
 
+// The value a Janet global holds. A var's is in its ref, which is also what
+// a cartridge's top-level defs become as it loads (see cache.c).
+static Janet janet_binding_value(JanetBinding binding) {
+    if (binding.type == JANET_BINDING_VAR) {
+        JanetArray *ref = janet_unwrap_array(binding.value);
+        return ref->count > 0 ? ref->data[0] : janet_wrap_nil();
+    }
+    return binding.value;
+}
+
 // Improved function for retrieving global strings
 void get_string_global(char *name, char *buf, size_t sz) {
     if (lang == LM_Fe) {
@@ -252,11 +537,12 @@ void get_string_global(char *name, char *buf, size_t sz) {
         } else if (j_binding.type != JANET_BINDING_DEF && j_binding.type != JANET_BINDING_VAR) {
             janet_panicf("Global '%s' must be a string definition", name);
         } else {
-            if (!janet_checktype(j_binding.value, JANET_STRING)) {
+            Janet value = janet_binding_value(j_binding);
+            if (!janet_checktype(value, JANET_STRING)) {
                 janet_panicf("Global '%s' must be a string", name);
             }
 
-            const char *str = (char *)janet_unwrap_string(j_binding.value);
+            const char *str = (char *)janet_unwrap_string(value);
             strncpy(buf, str, sz);
         }
     }
@@ -285,11 +571,12 @@ float get_number_global(char *name) {
         } else if (j_binding.type != JANET_BINDING_DEF && j_binding.type != JANET_BINDING_VAR) {
             janet_panicf("Global '%s' must be a number definition", name);
         } else {
-            if (!janet_checktype(j_binding.value, JANET_NUMBER)) {
+            Janet value = janet_binding_value(j_binding);
+            if (!janet_checktype(value, JANET_NUMBER)) {
                 janet_panicf("Global '%s' must be a number", name);
             }
 
-            return janet_unwrap_number(j_binding.value);
+            return janet_unwrap_number(value);
         }
     }
     return 0;
@@ -315,14 +602,23 @@ void __attribute__((format(printf, 2, 3))) raise_errorf(enum LangMode lang, cons
 
 // Enhanced address checking function with better error handling
 void check_user_address(enum LangMode lm, size_t addr, size_t sz, _Bool write) {
-    if ((write && bank == BK_Rom) || (addr + sz) >= MEMORY_SIZE) {
+    check_bank_address(lm, bank, addr, sz, write);
+}
+
+// Same as check_user_address(), for a range in any bank rather than the
+// current one.
+void check_bank_address(enum LangMode lm, size_t bk, size_t addr, size_t sz, _Bool write) {
+    if (bk >= bank_count)
+        raise_errorf(lm, "No such bank %zu.", bk);
+
+    if ((write && bk == BK_Rom) || sz >= MEMORY_SIZE || (addr + sz) >= MEMORY_SIZE) {
         const char *action = write ? "writeable" : "readable";
 
         if (sz == 1) {
-            raise_errorf(lm, "Address [%d]0x%04X not %s.", bank, addr, action);
+            raise_errorf(lm, "Address [%zu]0x%04zX not %s.", bk, addr, action);
         } else {
-            raise_errorf(lm, "Address [%d]0x%04X...%04X not %s.",
-                bank, addr, addr + (sz - 1), action);
+            raise_errorf(lm, "Address [%zu]0x%04zX...%04zX not %s.",
+                bk, addr, addr + (sz - 1), action);
         }
     }
 }